@@ -0,0 +1,384 @@
+#include "common/core_coord.h"
+#include "logger.hpp"
+#include "tt_metal/host_api.hpp"
+#include "common/bfloat16.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string_view>
+#include <vector>
+
+#include "common.hpp"
+#include "stream.hpp"
+
+using namespace tt;
+
+// DRAM reserved for traces when benchmarking captured maps.
+constexpr size_t TRACE_REGION_SIZE = 1 << 20;
+
+// Throughput benchmark for Map. Sweeps stream size, # of input ports, replication and batch size over an
+// elementwise sum kernel (out0 = in0 + in1 + ...), timing host -> device, the program and device -> host separately.
+// With --ops, sweeps the operators of the kernel library instead of port counts.
+
+// A library operator, with a host reference to check its results against.
+// Inputs cover [lo, hi], wide enough to take every branch of the operator (clamping, flushing, special cases, ...).
+struct Op {
+    std::string name;
+    uint32_t inputs;
+    float lo;
+    float hi;
+    std::function<current::Kernel()> make;
+    std::function<float(const std::vector<float>&)> reference;
+};
+
+const std::vector<Op>& library_ops() {
+    using current::Kernel;
+    static const std::vector<Op> ops = {
+        {"axpy", 2, -8.0f, 8.0f, [] { return Kernel::axpy(2.0f); }, [](const auto& in) { return 2.0f * in[0] + in[1]; }},
+        {"scale_bias", 1, -8.0f, 8.0f, [] { return Kernel::scale_bias(2.0f, 1.0f); }, [](const auto& in) { return 2.0f * in[0] + 1.0f; }},
+        {"multiply_add", 3, -8.0f, 8.0f, [] { return Kernel::multiply_add(); }, [](const auto& in) { return in[0] * in[1] + in[2]; }},
+        {"clamp", 1, -1.0f, 1.0f, [] { return Kernel::clamp(0.0f, 0.25f); }, [](const auto& in) { return std::clamp(in[0], 0.0f, 0.25f); }},
+        {"exp", 1, -100.0f, 88.0f, [] { return Kernel::exp(); }, [](const auto& in) { return std::exp(in[0]); }},
+        {"exp_approx", 1, -100.0f, 88.0f, [] { return Kernel::exp(true); }, [](const auto& in) { return std::exp(in[0]); }},
+        {"log", 1, -1.0f, 16.0f, [] { return Kernel::log(); }, [](const auto& in) { return std::log(in[0]); }},
+        {"log_approx", 1, -1.0f, 16.0f, [] { return Kernel::log(true); }, [](const auto& in) { return std::log(in[0]); }},
+        {"sigmoid", 1, -50.0f, 50.0f, [] { return Kernel::sigmoid(); }, [](const auto& in) { return 1.0f / (1.0f + std::exp(-in[0])); }},
+        {"sigmoid_approx", 1, -50.0f, 50.0f, [] { return Kernel::sigmoid(true); }, [](const auto& in) { return 1.0f / (1.0f + std::exp(-in[0])); }},
+        {"compare", 2, -8.0f, 8.0f, [] { return Kernel::compare(Kernel::Compare::Lt); }, [](const auto& in) { return in[0] < in[1] ? 1.0f : 0.0f; }},
+        {"select", 4, -8.0f, 8.0f, [] { return Kernel::select(Kernel::Compare::Lt); }, [](const auto& in) { return in[0] < in[1] ? in[2] : in[3]; }},
+    };
+    return ops;
+}
+
+const Op *find_op(const std::string& name) {
+    for (const auto& op : library_ops()) {
+        if (op.name == name) {
+            return &op;
+        }
+    }
+    return nullptr;
+}
+
+struct Config {
+    const Op *op; // nullptr for the sum kernel.
+    uint32_t count;
+    uint32_t ports;
+    uint32_t replicas; // 0 is Kernel::AUTO_REPLICAS.
+    uint32_t batch;
+};
+
+// NaNs and infinities have to come out exactly, anything else to within tolerance (relative, or absolute below 1).
+bool matches(float value, float expected, float tolerance) {
+    if (std::isnan(expected)) {
+        return std::isnan(value);
+    }
+    if (std::isinf(expected)) {
+        return value == expected;
+    }
+    return std::abs(value - expected) <= tolerance * std::max(1.0f, std::abs(expected));
+}
+
+std::string op_name(const Config& config) {
+    return config.op ? config.op->name : "sum";
+}
+
+struct Result {
+    Config config;
+    uint32_t replicas; // What the runtime actually picked.
+    current::PhaseTimings median;
+    double tiles_per_second;
+    uint32_t mismatches;
+};
+
+std::string next_arg(int& i, int argc, char **argv) {
+    if(i + 1 >= argc) {
+        std::cerr << "Expected argument after " << argv[i] << std::endl;
+        exit(1);
+    }
+    return argv[++i];
+}
+
+std::vector<uint32_t> parse_list(const std::string& arg) {
+    std::vector<uint32_t> values;
+    std::stringstream ss(arg);
+    std::string value;
+    while (std::getline(ss, value, ',')) {
+        values.push_back(std::stoul(value));
+    }
+    return values;
+}
+
+void help(std::string_view program_name) {
+    std::cout << "Usage: " << program_name << " [options]\n";
+    std::cout << "Benchmarks Map throughput across stream sizes, port counts, replication factors and batch sizes.\n";
+    std::cout << "\n";
+    std::cout << "Options:\n";
+    std::cout << "  --device, -d <device_id>  Specify the device to run the benchmark on. Default is 0.\n";
+    std::cout << "  --counts <n,n,...>        Elements per stream. Default is 65536,1048576.\n";
+    std::cout << "  --ports <n,n,...>         Input ports of the kernel, 1 to " << MAX_INPUT_PORTS << ". Default is 1,2,4,8,16.\n";
+    std::cout << "  --ops <op,op,...|all>     Benchmark kernel library operators instead of the sum kernel, ignoring --ports. One of:\n";
+    std::cout << "                           ";
+    for (const auto& op : library_ops()) {
+        std::cout << " " << op.name;
+    }
+    std::cout << "\n";
+    std::cout << "  --replicas <n,n,...>      Replicas of the kernel, 0 for automatic. Default is 1,8,0.\n";
+    std::cout << "  --batches <n,n,...>       Tiles per batch. Default is 1,4,8.\n";
+    std::cout << "  --warmup <n>              Untimed executions per configuration. Default is 2.\n";
+    std::cout << "  --reps <n>                Timed executions per configuration. Default is 10.\n";
+    std::cout << "  --capture                 Capture each map on its first execution and replay it from then on.\n";
+    std::cout << "  --csv <file>              Write results as CSV. Default is bench.csv.\n";
+    std::cout << "  --json <file>             Write results as JSON. Default is bench.json.\n";
+    exit(0);
+}
+
+double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2.0;
+}
+
+Result run(current::Session& session, const Config& config, uint32_t warmup, uint32_t reps, bool capture) {
+    // For the sum kernel every source is all ones, so every element of the sink should be the # of ports.
+    // Operators get a ramp over their input range instead, running the other way on every other input so comparisons
+    // and selects go both ways. Snapping to multiples of 1/64 makes sure it hits special values like 0 exactly.
+    std::vector<std::unique_ptr<current::Stream>> sources;
+    for (uint32_t i = 0; i < config.ports; i++) {
+        std::vector<float> values(config.count, 1.0f);
+        if (config.op) {
+            for (uint32_t j = 0; j < config.count; j++) {
+                float t = config.count > 1 ? (float)j / (config.count - 1) : 0.5f;
+                if (i % 2) {
+                    t = 1.0f - t;
+                }
+                values[j] = std::round((config.op->lo + (config.op->hi - config.op->lo) * t) * 64.0f) / 64.0f;
+            }
+        }
+        sources.push_back(std::make_unique<current::Stream>(values, tt::DataFormat::Float16_b));
+    }
+    current::Stream sink(config.count, tt::DataFormat::Float16_b);
+
+    current::Kernel kernel;
+    if (config.op) {
+        kernel = config.op->make();
+    } else {
+        std::string body = "        out0 = in0";
+        for (uint32_t i = 0; i < config.ports; i++) {
+            kernel.add_input_port("in" + std::to_string(i), tt::DataFormat::Float16_b);
+            if (i > 0) {
+                body += " + in" + std::to_string(i);
+            }
+        }
+        body += ";\n";
+        kernel.add_output_port("out0", tt::DataFormat::Float16_b);
+        kernel.set_compute_kernel(body);
+    }
+    kernel.set_num_replicas(config.replicas);
+
+    std::vector<current::Stream *> streams;
+    for (auto& source : sources) {
+        streams.push_back(source.get());
+    }
+    streams.push_back(&sink);
+    current::Map map({&kernel}, streams);
+    for (uint32_t i = 0; i < config.ports; i++) {
+        map.add_connection(sources[i].get(), &kernel, "in" + std::to_string(i));
+    }
+    map.add_connection(&kernel, "out0", &sink);
+    map.set_tiles_per_batch(config.batch);
+    map.set_phase_timing(true);
+    map.set_capture(capture);
+
+    // Warmup covers kernel compilation and filling the program cache.
+    for (uint32_t i = 0; i < warmup; i++) {
+        map.execute(session);
+    }
+    std::vector<double> setup, host_to_device, program, device_to_host;
+    for (uint32_t i = 0; i < reps; i++) {
+        map.execute(session);
+        const auto& timings = *map.get_phase_timings();
+        setup.push_back(timings.setup_seconds);
+        host_to_device.push_back(timings.host_to_device_seconds);
+        program.push_back(timings.program_seconds);
+        device_to_host.push_back(timings.device_to_host_seconds);
+    }
+
+    Result result;
+    result.config = config;
+    result.replicas = kernel.num_replicas;
+    result.median = {median(setup), median(host_to_device), median(program), median(device_to_host)};
+    uint32_t n_tiles = (config.count + TILE_SIZE - 1) / TILE_SIZE;
+    result.tiles_per_second = result.median.program_seconds > 0 ? n_tiles / result.median.program_seconds : 0.0;
+
+    // Operators are checked element by element against their reference, on the inputs as they were rounded to bfloat16.
+    // The sink only holds bfloat16 too, so results only have to match to within its precision.
+    std::vector<std::vector<float>> inputs;
+    for (const auto& source : sources) {
+        inputs.push_back(source->to_floats());
+    }
+    float tolerance = config.op ? 1.0f / 128 : 0.0f;
+    auto outputs = sink.to_floats();
+    std::vector<float> in(config.ports);
+    result.mismatches = 0;
+    for (uint32_t j = 0; j < config.count; j++) {
+        for (uint32_t i = 0; i < config.ports; i++) {
+            in[i] = inputs[i][j];
+        }
+        float expected = config.op ? config.op->reference(in) : (float)config.ports;
+        if (!matches(outputs[j], expected, tolerance)) {
+            result.mismatches++;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    int device_id = 0;
+    std::vector<uint32_t> counts = {65536, 1048576};
+    std::vector<uint32_t> ports = {1, 2, 4, 8, 16};
+    std::vector<const Op *> ops;
+    std::vector<uint32_t> replicas = {1, 8, current::Kernel::AUTO_REPLICAS};
+    std::vector<uint32_t> batches = {1, 4, 8};
+    uint32_t warmup = 2;
+    uint32_t reps = 10;
+    bool capture = false;
+    std::string csv_path = "bench.csv";
+    std::string json_path = "bench.json";
+
+    // Quick and dirty argument parsing.
+    for(int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if(arg == "--device" || arg == "-d") {
+            device_id = std::stoi(next_arg(i, argc, argv));
+        }
+        else if(arg == "--counts") {
+            counts = parse_list(next_arg(i, argc, argv));
+        }
+        else if(arg == "--ports") {
+            ports = parse_list(next_arg(i, argc, argv));
+        }
+        else if(arg == "--ops") {
+            std::string list = next_arg(i, argc, argv);
+            if (list == "all") {
+                for (const auto& op : library_ops()) {
+                    ops.push_back(&op);
+                }
+                continue;
+            }
+            std::stringstream ss(list);
+            std::string name;
+            while (std::getline(ss, name, ',')) {
+                auto op = find_op(name);
+                if (op == nullptr) {
+                    std::cerr << "Unknown operator: " << name << std::endl;
+                    exit(1);
+                }
+                ops.push_back(op);
+            }
+        }
+        else if(arg == "--replicas") {
+            replicas = parse_list(next_arg(i, argc, argv));
+        }
+        else if(arg == "--batches") {
+            batches = parse_list(next_arg(i, argc, argv));
+        }
+        else if(arg == "--warmup") {
+            warmup = std::stoul(next_arg(i, argc, argv));
+        }
+        else if(arg == "--reps") {
+            reps = std::stoul(next_arg(i, argc, argv));
+        }
+        else if(arg == "--capture") {
+            capture = true;
+        }
+        else if(arg == "--csv") {
+            csv_path = next_arg(i, argc, argv);
+        }
+        else if(arg == "--json") {
+            json_path = next_arg(i, argc, argv);
+        }
+        else if(arg == "--help" || arg == "-h") {
+            help(argv[0]);
+            return 0;
+        }
+        else {
+            std::cout << "Unknown argument: " << arg << std::endl;
+            help(argv[0]);
+        }
+    }
+    if (reps == 0) {
+        std::cerr << "Need at least one timed repetition" << std::endl;
+        exit(1);
+    }
+    for (auto n : ports) {
+        if (n < 1 || n > MAX_INPUT_PORTS) {
+            std::cerr << "Port count must be between 1 and " << MAX_INPUT_PORTS << std::endl;
+            exit(1);
+        }
+    }
+
+    // One session for the whole sweep, so device init isn't part of any measurement.
+    current::Session session(device_id, capture ? TRACE_REGION_SIZE : 0);
+
+    // Each operator takes the place of a port count, with however many inputs it has.
+    std::vector<std::pair<const Op *, uint32_t>> kernels;
+    if (ops.empty()) {
+        for (auto n_ports : ports) {
+            kernels.push_back({nullptr, n_ports});
+        }
+    } else {
+        for (auto op : ops) {
+            kernels.push_back({op, op->inputs});
+        }
+    }
+
+    std::vector<Result> results;
+    for (auto count : counts) {
+        for (auto [op, n_ports] : kernels) {
+            for (auto n_replicas : replicas) {
+                for (auto batch : batches) {
+                    Config config = {op, count, n_ports, n_replicas, batch};
+                    auto result = run(session, config, warmup, reps, capture);
+                    tt::log_info("op: {}, count: {}, ports: {}, replicas: {}, batch: {} -> program {:.6f}s, {:.0f} tiles/s, mismatches: {}",
+                                 op_name(config), count, n_ports, result.replicas, batch, result.median.program_seconds, result.tiles_per_second, result.mismatches);
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    std::ofstream csv(csv_path);
+    csv << "op,count,ports,requested_replicas,replicas,batch,setup_s,host_to_device_s,program_s,device_to_host_s,tiles_per_s,mismatches\n";
+    for (const auto& r : results) {
+        csv << op_name(r.config) << "," << r.config.count << "," << r.config.ports << "," << r.config.replicas << "," << r.replicas << "," << r.config.batch << ","
+            << r.median.setup_seconds << "," << r.median.host_to_device_seconds << "," << r.median.program_seconds << ","
+            << r.median.device_to_host_seconds << "," << r.tiles_per_second << "," << r.mismatches << "\n";
+    }
+
+    std::ofstream json(json_path);
+    json << "{\n";
+    json << "  \"warmup\": " << warmup << ",\n";
+    json << "  \"reps\": " << reps << ",\n";
+    json << "  \"capture\": " << (capture ? "true" : "false") << ",\n";
+    json << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        json << "    {\"op\": \"" << op_name(r.config) << "\", \"count\": " << r.config.count << ", \"ports\": " << r.config.ports
+             << ", \"requested_replicas\": " << r.config.replicas << ", \"replicas\": " << r.replicas << ", \"batch\": " << r.config.batch
+             << ", \"setup_s\": " << r.median.setup_seconds << ", \"host_to_device_s\": " << r.median.host_to_device_seconds
+             << ", \"program_s\": " << r.median.program_seconds << ", \"device_to_host_s\": " << r.median.device_to_host_seconds
+             << ", \"tiles_per_s\": " << r.tiles_per_second << ", \"mismatches\": " << r.mismatches << "}"
+             << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n";
+    json << "}\n";
+    tt::log_info("Wrote {} results to {} and {}", results.size(), csv_path, json_path);
+
+    return 0;
+}
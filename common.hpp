@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cassert>
+
 #include "common/bfloat16.hpp"
+#include "common/tt_backend_api_types.hpp"
 
 // TODO: Need to determine when/how these will be set. 
 // I think I might want to keep this constant for a given runtime program graph.
@@ -9,9 +12,71 @@
 constexpr uint32_t TILE_WIDTH = 32;
 constexpr uint32_t TILE_HEIGHT = 32;
 constexpr uint32_t TILE_SIZE = TILE_WIDTH * TILE_HEIGHT;
-constexpr uint32_t TILE_SIZE_BYTES = TILE_SIZE * sizeof(bfloat16);
-constexpr uint32_t TILES_PER_CB = 4;
+constexpr uint32_t TILE_SIZE_BYTES = TILE_SIZE * sizeof(bfloat16); // Of a bfloat16 tile, see tile_size_in_bytes() for other formats.
+// CB depths, in batches of tiles. Every CB is at least double buffered,
+// DRAM facing CBs get deepened up to MAX_BATCHES_PER_CB if L1 allows it.
+constexpr uint32_t MIN_BATCHES_PER_CB = 2;
+constexpr uint32_t MAX_BATCHES_PER_CB = 4;
+// L1 per core we keep away from CBs (firmware, kernel binaries, semaphores, runtime args, ...).
+constexpr uint32_t L1_RESERVED_BYTES = 200 * 1024;
+// Estimated cost of a function call (exp, reciprocal, ...) in an SFPI body, relative to a single arithmetic op.
+constexpr double SFPI_CALL_COST = 8.0;
+// Upper bound on improvement passes for the search based placement.
+constexpr uint32_t MAX_PLACEMENT_SEARCH_PASSES = 64;
 constexpr uint32_t IN_CB_START = 0;
 constexpr uint32_t OUT_CB_START = 16;
 constexpr uint32_t MAX_INPUT_PORTS = 16;
-constexpr uint32_t MAX_OUTPUT_PORTS = 16;
\ No newline at end of file
+constexpr uint32_t MAX_OUTPUT_PORTS = 16;
+// # of 16 bit tiles that fit in the DST registers. Half as many in 32 bit mode, and half again with half sync (see Map::set_dst_sync()).
+constexpr uint32_t DST_TILES = 16;
+constexpr uint32_t SFPI_ROWS_PER_TILE = 32; // A tile in DST, as seen from SFPI, is this many dst_reg rows of 32 datums.
+// Profiling records, one per RISC (reader, compute, writer) per core. Each is a set of 64 bit cycle counters:
+// [0] total, [1] NoC barrier, then two per port.
+constexpr uint32_t PROFILE_COUNTERS = 2 + 2 * (MAX_INPUT_PORTS > MAX_OUTPUT_PORTS ? MAX_INPUT_PORTS : MAX_OUTPUT_PORTS);
+constexpr uint32_t PROFILE_RECORD_BYTES = PROFILE_COUNTERS * sizeof(uint64_t);
+constexpr uint32_t PROFILE_RECORDS_PER_CORE = 3;
+// Watchdog records, one per RISC per core, see Map::set_watchdog(). Words:
+// [0] 1 once the RISC has started, 2 once it's done, [1] what the reader/writer (or compute's unpacker) is blocked on,
+// [2] what compute's packer is blocked on, then tiles through every input port and every output port.
+constexpr uint32_t WATCHDOG_INPUT_TILES = 3;
+constexpr uint32_t WATCHDOG_OUTPUT_TILES = WATCHDOG_INPUT_TILES + MAX_INPUT_PORTS;
+constexpr uint32_t WATCHDOG_RECORD_BYTES = (WATCHDOG_OUTPUT_TILES + MAX_OUTPUT_PORTS) * sizeof(uint32_t);
+constexpr uint32_t WATCHDOG_RECORDS_PER_CORE = 3;
+// How often the host reads the watchdog records back while waiting on an execution.
+constexpr double WATCHDOG_POLL_SECONDS = 0.1;
+// Host side float conversions only get split across threads in blocks of at least this many words.
+constexpr size_t HOST_CONVERSION_BLOCK_WORDS = 64 * 1024;
+
+// Tile formats streams and ports can carry.
+inline bool is_supported_data_format(tt::DataFormat data_format) {
+    switch (data_format) {
+        case tt::DataFormat::Bfp8_b:
+        case tt::DataFormat::Float16_b:
+        case tt::DataFormat::Float32:
+        case tt::DataFormat::Int32:
+        case tt::DataFormat::UInt32:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Formats that need the DST registers in 32 bit mode to not lose precision. DST then only holds half as many tiles.
+inline bool is_32bit_data_format(tt::DataFormat data_format) {
+    return data_format == tt::DataFormat::Float32 || data_format == tt::DataFormat::Int32 || data_format == tt::DataFormat::UInt32;
+}
+
+// Size of a single tile in the given format.
+// Bfp8_b stores a byte per datum, plus one shared exponent byte for every 16 datums.
+inline uint32_t tile_size_in_bytes(tt::DataFormat data_format) {
+    switch (data_format) {
+        case tt::DataFormat::Bfp8_b: return TILE_SIZE + TILE_SIZE / 16;
+        case tt::DataFormat::Float16_b: return TILE_SIZE * 2;
+        case tt::DataFormat::Float32:
+        case tt::DataFormat::Int32:
+        case tt::DataFormat::UInt32: return TILE_SIZE * 4;
+        default:
+            assert(false && "Unsupported data format!");
+            return 0;
+    }
+}
@@ -31,19 +31,25 @@ std::shared_ptr<Buffer> MakeBuffer(Device *device, uint32_t size, uint32_t page_
     return CreateBuffer(config);
 }
 
-// Allocate a buffer on DRAM or SRAM. Assuming the buffer holds BFP16 data.
-// A tile on Tenstorrent is 32x32 elements, given us using BFP16, we need 2 bytes per element.
-// Making the tile size 32x32x2 = 2048 bytes.
+// Allocate a buffer of n_tiles tiles in the given format on DRAM or SRAM.
+// A tile on Tenstorrent is 32x32 elements, its size in bytes depends on the format (see tile_size_in_bytes()).
 // @param device: The device to allocate the buffer on.
 // @param n_tiles: The number of tiles to allocate.
+// @param format: The data format of the tiles.
 // @param sram: If true, allocate the buffer on SRAM, otherwise allocate it on DRAM.
-std::shared_ptr<Buffer> MakeBufferBFP16(Device *device, uint32_t n_tiles, bool sram) {
-    constexpr uint32_t tile_size = sizeof(bfloat16) * TILE_WIDTH * TILE_HEIGHT;
+std::shared_ptr<Buffer> MakeBufferTiles(Device *device, uint32_t n_tiles, tt::DataFormat format, bool sram) {
+    const uint32_t tile_size = tile_size_in_bytes(format);
     // For simplicity, all DRAM buffers have page size = tile size.
     const uint32_t page_tiles = sram ? n_tiles : 1;
     return MakeBuffer(device, tile_size * n_tiles, page_tiles * tile_size, sram);
 }
 
+// Allocate a buffer on DRAM or SRAM. Assuming the buffer holds BFP16 data.
+// Given us using BFP16, we need 2 bytes per element, making the tile size 32x32x2 = 2048 bytes.
+std::shared_ptr<Buffer> MakeBufferBFP16(Device *device, uint32_t n_tiles, bool sram) {
+    return MakeBufferTiles(device, n_tiles, tt::DataFormat::Float16_b, sram);
+}
+
 CBHandle MakeCircularBuffer(Program& program, const CoreSpec& core, tt::CB cb, uint32_t size, uint32_t page_size, tt::DataFormat format) {
     CircularBufferConfig cb_src0_config = CircularBufferConfig(
         size,
@@ -62,9 +68,14 @@ CBHandle MakeCircularBuffer(Program& program, const CoreSpec& core, tt::CB cb, u
 // @param core: The core to create the circular buffer on.
 // @param cb: Which circular buffer to create (c_in0, c_in1, c_out0, c_out1, etc..). This is just an ID
 // @param n_tiles: The number of tiles the circular buffer can hold.
+// @param format: The data format of the tiles.
+CBHandle MakeCircularBufferTiles(Program& program, const CoreSpec& core, tt::CB cb, uint32_t n_tiles, tt::DataFormat format) {
+    const uint32_t tile_size = tile_size_in_bytes(format);
+    return MakeCircularBuffer(program, core, cb, n_tiles * tile_size, tile_size, format);
+}
+
 CBHandle MakeCircularBufferBFP16(Program& program, const CoreSpec& core, tt::CB cb, uint32_t n_tiles) {
-    constexpr uint32_t tile_size = sizeof(bfloat16) * TILE_WIDTH * TILE_HEIGHT;
-    return MakeCircularBuffer(program, core, cb, n_tiles * tile_size, tile_size, tt::DataFormat::Float16_b);
+    return MakeCircularBufferTiles(program, core, cb, n_tiles, tt::DataFormat::Float16_b);
 }
 
 std::string next_arg(int& i, int argc, char **argv) {
@@ -108,6 +119,10 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Open the device once up front, it's shared by every execution below.
+    // Needs to outlive the streams since they hold on to device buffers.
+    current::Session session(device_id);
+
     // Device and program setup.
     // Device *device = CreateDevice(device_id);
     // Program program = CreateProgram();
@@ -125,7 +140,7 @@ int main(int argc, char **argv) {
 
     // Count determines how many tokens will be generated by our streams.
     uint32_t count = 1024 * 2;
-    uint32_t n_tiles = std::ceil(count / TILE_SIZE);
+    uint32_t n_tiles = (count + TILE_SIZE - 1) / TILE_SIZE;
     tt::log_info("count: {}, n_tiles: {}", count, n_tiles);
 
     // // Divide tiles equally among cores.
@@ -146,7 +161,6 @@ int main(int argc, char **argv) {
     std::vector<uint32_t> generator0_data = create_constant_vector_of_bfloat16(TILE_SIZE * n_tiles * 2, 1.0f);
     std::vector<uint32_t> generator1_data = create_constant_vector_of_bfloat16(TILE_SIZE * n_tiles * 2, 2.0f);
     std::vector<uint32_t> generator2_data = create_constant_vector_of_bfloat16(TILE_SIZE * n_tiles * 2, 4.0f);
-    std::vector<uint32_t> output_data = create_constant_vector_of_bfloat16(TILE_SIZE * n_tiles * 2, 0.0f);
     // EnqueueWriteBuffer(cq, generator_buffer, generator_data, true);
     // tt::log_info("Wrote generator buffer to DRAM");
 
@@ -169,12 +183,15 @@ int main(int argc, char **argv) {
     saxpy_kernel.set_compute_kernel(R"(
         out0 = in2;
     )");
+    // Spread the kernel across as many cores as there are tiles.
+    saxpy_kernel.set_num_replicas(current::Kernel::AUTO_REPLICAS);
 
     // Define streams.
-    current::Stream source0(generator0_data, count, tt::DataFormat::Float16_b);
-    current::Stream source1(generator1_data, count, tt::DataFormat::Float16_b);
-    current::Stream source2(generator2_data, count, tt::DataFormat::Float16_b);
-    current::Stream sink(output_data, count, tt::DataFormat::Float16_b);
+    // Sources take over the generated data, the sink allocates its own zeroed storage.
+    current::Stream source0(std::move(generator0_data), count, tt::DataFormat::Float16_b);
+    current::Stream source1(std::move(generator1_data), count, tt::DataFormat::Float16_b);
+    current::Stream source2(std::move(generator2_data), count, tt::DataFormat::Float16_b);
+    current::Stream sink(count, tt::DataFormat::Float16_b);
 
     // Define connections between streams and kernels.
     current::Map map({&saxpy_kernel}, {&source0, &source1, &source2, &sink});
@@ -185,7 +202,17 @@ int main(int argc, char **argv) {
     map.export_dot("stream_graph.dot");
     map.generate_device_kernels();
     map.check_connections();
-    map.execute();
+    map.execute(session);
+
+    // The results land in the sink's host data, check them against what saxpy should produce.
+    std::vector<bfloat16> result = unpack_uint32_vec_into_bfloat16_vec(std::vector<uint32_t>(sink.data().begin(), sink.data().end()));
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < result.size(); i++) {
+        if (result[i].to_float() != 4.0f) {
+            mismatches++;
+        }
+    }
+    tt::log_info("result[0]: {}, mismatches: {} / {}", result[0].to_float(), mismatches, result.size());
 
     return 0;
 }
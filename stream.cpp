@@ -1,8 +1,16 @@
 #include "stream.hpp"
 
+#include <cctype>
+#include <cstring>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
+#include <regex>
 #include <sstream>
 #include <fstream>
+#include <atomic>
+#include <bit>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -10,40 +18,172 @@
 #include "current/common.hpp"
 #include "impl/buffers/buffer.hpp"
 #include "impl/buffers/circular_buffer_types.hpp"
+#include "tt_metal/detail/tt_metal.hpp"
+#include "tt_metal/llrt/tt_cluster.hpp"
 #include "work_split.hpp"
 
 namespace current {
 
+// Runs f(begin, end) over blocks of [0, n) on every host thread. Small jobs stay on the calling thread.
+template <typename F>
+static void parallel_blocks(size_t n, F f) {
+    size_t num_threads = std::clamp<size_t>(n / HOST_CONVERSION_BLOCK_WORDS, 1, std::max(std::thread::hardware_concurrency(), 1u));
+    size_t block = (n + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; t++) {
+        threads.emplace_back(f, std::min(t * block, n), std::min((t + 1) * block, n));
+    }
+    f(0, std::min(block, n));
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// The conversions below are kept branch free so the compiler vectorizes them (AVX2/AVX-512 when targeting it).
+static inline uint32_t float_to_bfloat16_bits(float value) {
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    uint32_t rounded = (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+    // Rounding could carry a NaN into infinity, so quiet it instead.
+    return (bits & 0x7FFFFFFF) > 0x7F800000 ? (bits >> 16) | 0x40 : rounded;
+}
+
+static inline float bfloat16_bits_to_float(uint32_t bits) {
+    return std::bit_cast<float>(bits << 16);
+}
+
+Stream::Stream(std::span<const float> values, tt::DataFormat data_format) {
+    owned_data.resize(size_in_bytes(values.size(), data_format) / sizeof(uint32_t));
+    init(std::span<uint32_t>(owned_data), values.size(), data_format);
+    write_floats(values);
+}
+
+void Stream::write_floats(std::span<const float> values) {
+    assert(values.size() == n_elements && "# of values doesn't match the stream!");
+    assert(!host_data.empty() && "Stream has no host data to write into!");
+    const float *in = values.data();
+    uint32_t *out = host_data.data();
+    if (data_format == tt::DataFormat::Float16_b) {
+        // Two bfloat16s per word, the first one in the low half. An odd last element gets a zero high half.
+        parallel_blocks(n_elements / 2, [=](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                out[i] = float_to_bfloat16_bits(in[2 * i]) | (float_to_bfloat16_bits(in[2 * i + 1]) << 16);
+            }
+        });
+        if (n_elements % 2 != 0) {
+            out[n_elements / 2] = float_to_bfloat16_bits(in[n_elements - 1]);
+        }
+    } else {
+        assert(data_format == tt::DataFormat::Float32 && "Float conversions only support Float16_b and Float32 streams!");
+        parallel_blocks(host_data.size(), [=](size_t begin, size_t end) {
+            std::memcpy(out + begin, in + begin, (end - begin) * sizeof(uint32_t));
+        });
+    }
+}
+
+void Stream::read_floats(std::span<float> values) const {
+    assert(values.size() == n_elements && "# of values doesn't match the stream!");
+    const uint32_t *in = host_data.data();
+    float *out = values.data();
+    if (data_format == tt::DataFormat::Float16_b) {
+        parallel_blocks(n_elements / 2, [=](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                out[2 * i] = bfloat16_bits_to_float(in[i] & 0xFFFF);
+                out[2 * i + 1] = bfloat16_bits_to_float(in[i] >> 16);
+            }
+        });
+        if (n_elements % 2 != 0) {
+            out[n_elements - 1] = bfloat16_bits_to_float(in[n_elements / 2] & 0xFFFF);
+        }
+    } else {
+        assert(data_format == tt::DataFormat::Float32 && "Float conversions only support Float16_b and Float32 streams!");
+        parallel_blocks(host_data.size(), [=](size_t begin, size_t end) {
+            std::memcpy(out + begin, in + begin, (end - begin) * sizeof(uint32_t));
+        });
+    }
+}
+
+std::vector<float> Stream::to_floats() const {
+    std::vector<float> values(n_elements);
+    read_floats(values);
+    return values;
+}
+
+Stream Stream::view(Stream& base, size_t offset_tiles, size_t n_tiles, size_t stride_tiles) {
+    assert(n_tiles > 0 && stride_tiles > 0 && "Views need at least one tile and a non-zero stride!");
+    assert(offset_tiles + (n_tiles - 1) * stride_tiles < base.n_tiles && "View reaches past the end of the stream!");
+    if (base.is_view()) {
+        // base reads tiles base.offset + i * base.stride of its own base, so compose the two.
+        assert(base.view_indices == nullptr && "Can't take a view of a gather!");
+        return Stream(ViewOf{}, *base.view_base, nullptr, base.view_offset + offset_tiles * base.view_stride, n_tiles, stride_tiles * base.view_stride);
+    }
+    return Stream(ViewOf{}, base, nullptr, offset_tiles, n_tiles, stride_tiles);
+}
+
+Stream Stream::gather(Stream& base, Stream& indices) {
+    assert(!base.is_view() && !indices.is_view() && "Gathers read from a stream directly!");
+    assert(indices.data_format == tt::DataFormat::UInt32 && "Gather indices have to be UInt32!");
+    for (size_t i = 0; i < indices.n_elements && i < indices.host_data.size(); i++) {
+        assert(indices.host_data[i] < base.n_tiles && "Gather index past the end of the stream!");
+    }
+    return Stream(ViewOf{}, base, &indices, 0, indices.n_elements, 1);
+}
+
+Stream::Stream(ViewOf, Stream& base, Stream *indices, size_t offset_tiles, size_t n_tiles, size_t stride_tiles) {
+    n_elements = n_tiles * TILE_SIZE;
+    this->tile_size_bytes = base.tile_size_bytes;
+    this->data_format = base.data_format;
+    this->n_tiles = n_tiles;
+    memory = base.memory;
+    view_base = &base;
+    view_indices = indices;
+    view_offset = offset_tiles;
+    view_stride = stride_tiles;
+}
+
 
 // Add a new input or output port to the kernel
 void Kernel::add_input_port(const std::string& name, tt::DataFormat data_format)  {
     assert(input_ports.size() < MAX_INPUT_PORTS && "Kernel has too many input ports!");
+    assert(is_supported_data_format(data_format) && "Unsupported port data format!");
     
-    // Check if port name already exists in input ports
-    for (const auto& port : input_ports) {
-        assert(port.name != name && "Input port with this name already exists!");
-    }
-    // Check if port name already exists in output ports
-    for (const auto& port : output_ports) {
-        assert(port.name != name && "Port name already exists as an output port!");
-    }
-    
+    assert(!input_port_indices.contains(name) && "Input port with this name already exists!");
+    assert(!output_port_indices.contains(name) && "Port name already exists as an output port!");
+
+    input_port_indices[name] = input_ports.size();
     input_ports.push_back({name, data_format});
 }
 
 void Kernel::add_output_port(const std::string& name, tt::DataFormat data_format) {
     assert(output_ports.size() < MAX_OUTPUT_PORTS && "Kernel has too many output ports!");
+    assert(is_supported_data_format(data_format) && "Unsupported port data format!");
     
-    // Check if port name already exists in output ports
-    for (const auto& port : output_ports) {
-        assert(port.name != name && "Output port with this name already exists!");
+    assert(!output_port_indices.contains(name) && "Output port with this name already exists!");
+    assert(!input_port_indices.contains(name) && "Port name already exists as an input port!");
+
+    output_port_indices[name] = output_ports.size();
+    output_ports.push_back({name, data_format});
+}
+
+void Kernel::set_port_rate(const std::string& name, uint32_t tiles) {
+    assert(tiles > 0 && "Port rate must be non-zero!");
+    if (auto it = input_port_indices.find(name); it != input_port_indices.end()) {
+        input_ports[it->second].rate = tiles;
+    } else if (auto it = output_port_indices.find(name); it != output_port_indices.end()) {
+        output_ports[it->second].rate = tiles;
+    } else {
+        assert(false && "Port not found!");
     }
-    // Check if port name already exists in input ports
-    for (const auto& port : input_ports) {
-        assert(port.name != name && "Port name already exists as an input port!");
+}
+
+void Kernel::set_reduction(Reduction op, uint32_t window) {
+    reduction = op;
+    reduction_window = op == Reduction::None ? 0 : window;
+    for (auto& port : input_ports) {
+        port.rate = std::max<uint32_t>(reduction_window, 1);
+    }
+    for (auto& port : output_ports) {
+        port.rate = 1;
     }
-    
-    output_ports.push_back({name, data_format});
 }
 
 uint32_t Kernel::num_input_ports() const {
@@ -54,20 +194,295 @@ uint32_t Kernel::num_output_ports() const {
     return output_ports.size();
 }
 
+void Kernel::set_eltwise_op(EltwiseOp op) {
+    switch (op) {
+        case EltwiseOp::Copy: set_compute_kernel("        out0 = in0;\n"); break;
+        case EltwiseOp::Add: set_compute_kernel("        out0 = in0 + in1;\n"); break;
+        case EltwiseOp::Sub: set_compute_kernel("        out0 = in0 - in1;\n"); break;
+        case EltwiseOp::Mul: set_compute_kernel("        out0 = in0 * in1;\n"); break;
+    }
+}
+
+std::optional<Kernel::Eltwise> Kernel::eltwise_op() const {
+    std::string body;
+    for (char c : sfpi_kernel_string) {
+        if (!std::isspace(c)) {
+            body += c;
+        }
+    }
+    // Without a body the inputs pass straight through.
+    if (body.empty() && output_ports.size() == 1 && !input_ports.empty()) {
+        return Eltwise{EltwiseOp::Copy, 0, 0};
+    }
+    static const std::regex pattern(R"(out0=in(\d+)(?:([-+*])in(\d+))?;)");
+    std::smatch match;
+    if (output_ports.size() != 1 || !std::regex_match(body, match, pattern)) {
+        return std::nullopt;
+    }
+    uint32_t lhs = std::stoul(match[1]);
+    if (!match[2].matched) {
+        return Eltwise{EltwiseOp::Copy, lhs, lhs};
+    }
+    char op = match[2].str()[0];
+    return Eltwise{op == '+' ? EltwiseOp::Add : op == '-' ? EltwiseOp::Sub : EltwiseOp::Mul, lhs, (uint32_t)std::stoul(match[3])};
+}
+
+double Kernel::estimated_cost() const {
+    if (cost > 0) {
+        return cost;
+    }
+    // The FPU does a whole tile in a handful of cycles, so these are about as cheap as just moving the tiles.
+    if (eltwise_op()) {
+        return 1.0;
+    }
+    // Rough estimate from the SFPI body: every arithmetic op is about one SFPU instruction,
+    // while calls (exp, reciprocal, ...) expand into much longer instruction sequences.
+    double estimate = 1.0;
+    const std::string& body = sfpi_kernel_string;
+    for (size_t i = 0; i < body.size(); i++) {
+        char c = body[i];
+        if (c == '+' || c == '-' || c == '*' || c == '/') {
+            estimate += 1.0;
+        } else if (c == '(' && i > 0) {
+            size_t end = body.find_last_not_of(" \t", i - 1);
+            if (end == std::string::npos || !(std::isalnum(body[end]) || body[end] == '_')) {
+                continue;
+            }
+            size_t begin = end;
+            while (begin > 0 && (std::isalnum(body[begin - 1]) || body[begin - 1] == '_')) {
+                begin--;
+            }
+            std::string name = body.substr(begin, end - begin + 1);
+            // Control flow isn't a call.
+            if (name != "if" && name != "for" && name != "while" && name != "v_if" && name != "v_elseif") {
+                estimate += SFPI_CALL_COST;
+            }
+        }
+    }
+    return estimate;
+}
+
+void Kernel::set_parameter(const std::string& name, float value) {
+    // Parameters end up as variables in the body, next to inN/outN and the generated parameterN args.
+    static const std::regex identifier(R"([A-Za-z_][A-Za-z0-9_]*)");
+    static const std::regex reserved(R"((in|out|parameter)\d+)");
+    assert(std::regex_match(name, identifier) && !std::regex_match(name, reserved) && "Parameter name must be an identifier, and not inN/outN/parameterN!");
+    for (auto& parameter : parameters) {
+        if (parameter.name == name) {
+            parameter.value = value;
+            return;
+        }
+    }
+    parameters.push_back({name, value});
+}
+
+// Horner form of coefficients[0] + coefficients[1] * x + ..., as an SFPI expression.
+static std::string sfpi_polynomial(const std::string& x, const std::vector<std::string>& coefficients) {
+    std::string expression = coefficients.back();
+    for (size_t i = coefficients.size() - 1; i-- > 0;) {
+        expression = "(" + expression + ") * " + x + " + " + coefficients[i];
+    }
+    return expression;
+}
+
+// exp(in) into out, for an SFPI body. exp(x) = 2^n * 2^f with n = round(x * log2(e)), f in [-0.5, 0.5].
+// n comes from adding 1.5 * 2^23, which leaves round(x * log2(e)) in the low mantissa bits, and goes straight into the exponent of 2^f.
+// 2^f is a near minimax polynomial, degree 5 is good to ~1e-7 and degree 3 to ~1e-4.
+static std::string sfpi_exp(const std::string& out, const std::string& in, bool approx) {
+    std::vector<std::string> exp2 = approx
+        ? std::vector<std::string>{"0.999924557f", "0.693136734f", "0.242639479f", "0.0558382829f"}
+        : std::vector<std::string>{"1.00000008f", "0.693147188f", "0.240221075f", "0.0555035711f", "0.00967603192f", "0.00133908634f"};
+    std::string code;
+    code += "        {\n";
+    code += "        vFloat x = " + in + ";\n";
+    code += "        v_if (x > 88.0f) { x = 88.0f; }\n";
+    code += "        v_elseif (x < -88.0f) { x = -88.0f; }\n";
+    code += "        v_endif;\n";
+    code += "        vFloat t = x * 1.44269504f;\n";
+    code += "        vFloat shifted = t + 12582912.0f;\n";
+    code += "        vFloat f = t - (shifted - 12582912.0f);\n";
+    code += "        vInt n = reinterpret<vInt>(shifted) - 0x4B400000;\n";
+    code += "        vFloat p = " + sfpi_polynomial("f", exp2) + ";\n";
+    code += "        vInt e = exexp_nodebias(p) + n;\n";
+    code += "        " + out + " = setexp(p, e);\n";
+    // Flush what would be denormals, like the rest of the SFPU does.
+    code += "        v_if (e < 1) { " + out + " = 0.0f; }\n";
+    code += "        v_endif;\n";
+    code += "        }\n";
+    return code;
+}
+
+static Kernel library_kernel(uint32_t n_inputs, tt::DataFormat data_format, const std::string& body) {
+    assert((data_format == tt::DataFormat::Float32 || !is_32bit_data_format(data_format)) && "Library operators work on floats!");
+    Kernel kernel;
+    for (uint32_t i = 0; i < n_inputs; i++) {
+        kernel.add_input_port("in" + std::to_string(i), data_format);
+    }
+    kernel.add_output_port("out0", data_format);
+    kernel.set_compute_kernel(body);
+    return kernel;
+}
+
+static std::string compare_operator(Kernel::Compare op) {
+    switch (op) {
+        case Kernel::Compare::Lt: return "<";
+        case Kernel::Compare::Le: return "<=";
+        case Kernel::Compare::Gt: return ">";
+        case Kernel::Compare::Ge: return ">=";
+        case Kernel::Compare::Eq: return "==";
+        case Kernel::Compare::Ne: return "!=";
+    }
+    return "";
+}
+
+Kernel Kernel::axpy(float a, tt::DataFormat data_format) {
+    // A single SFPMAD per row.
+    auto kernel = library_kernel(2, data_format, "        out0 = a * in0 + in1;\n");
+    kernel.set_parameter("a", a);
+    return kernel;
+}
+
+Kernel Kernel::scale_bias(float scale, float bias, tt::DataFormat data_format) {
+    auto kernel = library_kernel(1, data_format, "        out0 = scale * in0 + bias;\n");
+    kernel.set_parameter("scale", scale);
+    kernel.set_parameter("bias", bias);
+    return kernel;
+}
+
+Kernel Kernel::multiply_add(tt::DataFormat data_format) {
+    return library_kernel(3, data_format, "        out0 = in0 * in1 + in2;\n");
+}
+
+Kernel Kernel::clamp(float lo, float hi, tt::DataFormat data_format) {
+    assert(lo <= hi && "Empty clamp range!");
+    auto kernel = library_kernel(1, data_format,
+        "        out0 = in0;\n"
+        "        v_if (in0 < lo) { out0 = lo; }\n"
+        "        v_elseif (in0 > hi) { out0 = hi; }\n"
+        "        v_endif;\n");
+    kernel.set_parameter("lo", lo);
+    kernel.set_parameter("hi", hi);
+    return kernel;
+}
+
+Kernel Kernel::exp(bool approx, tt::DataFormat data_format) {
+    return library_kernel(1, data_format, sfpi_exp("out0", "in0", approx));
+}
+
+Kernel Kernel::log(bool approx, tt::DataFormat data_format) {
+    // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), so ln(x) = e * ln(2) + ln(m), and ln(m) = z * q(z) with z = m - 1.
+    // q is a near minimax polynomial, degree 7 is good to ~2e-7 and degree 3 to ~4e-4, relative.
+    // e goes back to a float by the same trick as exp: 1.5 * 2^23 + e has e in its low mantissa bits.
+    std::vector<std::string> q = approx
+        ? std::vector<std::string>{"0.999731068f", "-0.502323656f", "0.353632072f", "-0.223625632f"}
+        : std::vector<std::string>{"0.999999968f", "-0.500003751f", "0.33334606f", "-0.24968907f", "0.199133479f", "-0.172782061f", "0.161262479f", "-0.0989535074f"};
+    std::string body;
+    body += "        {\n";
+    body += "        vInt e = exexp(in0);\n";
+    body += "        vFloat m = setexp(in0, 127);\n";
+    body += "        v_if (m >= 1.41421356f) {\n";
+    body += "            m = m * 0.5f;\n";
+    body += "            e = e + 1;\n";
+    body += "        }\n";
+    body += "        v_endif;\n";
+    body += "        vFloat z = m - 1.0f;\n";
+    body += "        vFloat ef = reinterpret<vFloat>(e + 0x4B400000) - 12582912.0f;\n";
+    body += "        out0 = ef * 0.693147181f + z * (" + sfpi_polynomial("z", q) + ");\n";
+    body += "        v_if (in0 == 0.0f) { out0 = s2vFloat16b(0xFF80); }\n";  // -inf
+    body += "        v_elseif (in0 < 0.0f) { out0 = s2vFloat16b(0x7FC0); }\n"; // NaN
+    body += "        v_endif;\n";
+    body += "        }\n";
+    return library_kernel(1, data_format, body);
+}
+
+Kernel Kernel::sigmoid(bool approx, tt::DataFormat data_format) {
+    // sigmoid(|x|) = 1 / y with y = 1 + exp(-|x|) in (1, 2], and sigmoid(x) = 1 - sigmoid(|x|) below 0.
+    // Keeping y in (1, 2] makes the reciprocal a few Newton steps from a linear first guess (relative error 0.059),
+    // each one squaring the error. Past 40, sigmoid(x) rounds to 0 or 1 anyway.
+    std::string body;
+    body += "        {\n";
+    body += "        vFloat neg = setsgn(in0, 1);\n";
+    body += "        v_if (neg < -40.0f) { neg = -40.0f; }\n";
+    body += "        v_endif;\n";
+    body += "        vFloat y;\n";
+    body += sfpi_exp("y", "neg", approx);
+    body += "        y = y + 1.0f;\n";
+    body += "        vFloat r = 1.411f - 0.47f * y;\n";
+    for (int i = 0; i < (approx ? 2 : 3); i++) {
+        body += "        r = r * (2.0f - y * r);\n";
+    }
+    body += "        out0 = r;\n";
+    body += "        v_if (in0 < 0.0f) { out0 = 1.0f - r; }\n";
+    body += "        v_endif;\n";
+    body += "        }\n";
+    return library_kernel(1, data_format, body);
+}
+
+Kernel Kernel::compare(Compare op, tt::DataFormat data_format) {
+    return library_kernel(2, data_format,
+        "        out0 = 0.0f;\n"
+        "        v_if (in0 " + compare_operator(op) + " in1) { out0 = 1.0f; }\n"
+        "        v_endif;\n");
+}
+
+Kernel Kernel::select(Compare op, tt::DataFormat data_format) {
+    return library_kernel(4, data_format,
+        "        out0 = in3;\n"
+        "        v_if (in0 " + compare_operator(op) + " in1) { out0 = in2; }\n"
+        "        v_endif;\n");
+}
+
 Map::Map(std::vector<Kernel *> kernels, std::vector<Stream *> streams) : kernels(kernels), streams(streams) {
-    // Check that all streams have the same number of elements.
-    for (size_t i = 1; i < streams.size(); i++) {
-        // TODO: Eventually we want to support streams of different sizes e.g for reduction kernels,
-        // but right now we just check that all streams have the same number of elements.
-        assert(streams[i]->n_elements == streams[0]->n_elements && "All streams must have the same number of elements!");
+    // Streams can differ in size (e.g reductions), check_connections() makes sure they line up with the kernels' port rates.
+    rebuild_graph();
+}
+
+Map::~Map() {
+    release_capture();
+}
+
+void Map::rebuild_graph() {
+    graph = Graph();
+    for (size_t i = 0; i < kernels.size(); i++) {
+        bool inserted = graph.kernel_index.emplace(kernels[i], i).second;
+        assert(inserted && "Kernel is in the map more than once!");
+    }
+    for (size_t i = 0; i < streams.size(); i++) {
+        bool inserted = graph.stream_index.emplace(streams[i], i).second;
+        assert(inserted && "Stream is in the map more than once!");
+    }
+    graph.incoming.resize(kernels.size());
+    graph.outgoing.resize(kernels.size());
+    graph.readers.resize(streams.size());
+    graph.writers.resize(streams.size());
+    for (size_t c = 0; c < connections.size(); c++) {
+        add_to_graph(c);
     }
 }
 
+void Map::add_to_graph(size_t connection_idx) {
+    const auto& connection = connections[connection_idx];
+    if (connection.source.is_kernel()) {
+        graph.outgoing[connection.source.index].push_back(connection_idx);
+    } else {
+        graph.readers[connection.source.index].push_back(connection_idx);
+    }
+    if (connection.dest.is_kernel()) {
+        graph.incoming[connection.dest.index].push_back(connection_idx);
+    } else {
+        graph.writers[connection.dest.index].push_back(connection_idx);
+    }
+    graph.ordered = false;
+}
+
 // TODO: Validate that port connections are valid (check that types are the same.)
 void Map::add_connection(Kernel *src, std::string src_out, Kernel *dst, std::string dst_in) {
     // TODO: Add error handling.
     auto src_kernel_idx = get_kernel_index(src);
     auto dst_kernel_idx = get_kernel_index(dst);
+    assert(src_kernel_idx != dst_kernel_idx && "Kernel can't be connected to itself!");
+    // Tiles are copied as-is between CBs, so both ends need to agree on the format.
+    assert(src->get_output_port(src_out).data_format == dst->get_input_port(dst_in).data_format && "Connected ports must have the same data format!");
     Endpoint src_endpoint = {Endpoint::EndpointType::Kernel, src_kernel_idx, src_out};
     Endpoint dst_endpoint = {Endpoint::EndpointType::Kernel, dst_kernel_idx, dst_in};
     tt::log_info("[CURRENT] Adding connection from kernel {} to kernel {}", src_kernel_idx, dst_kernel_idx);
@@ -77,6 +492,8 @@ void Map::add_connection(Kernel *src, std::string src_out, Kernel *dst, std::str
 void Map::add_connection(Stream *src, Kernel *dst, std::string dst_in) {
     auto src_stream_idx = get_stream_index(src);
     auto dst_kernel_idx = get_kernel_index(dst);
+    // DRAM pages are read into the CB as-is. Converting between formats is up to the compute kernel, between its ports.
+    assert(src->data_format == dst->get_input_port(dst_in).data_format && "Stream and port must have the same data format!");
     Endpoint src_endpoint = {Endpoint::EndpointType::Stream, src_stream_idx, ""};
     Endpoint dst_endpoint = {Endpoint::EndpointType::Kernel, dst_kernel_idx, dst_in};
     tt::log_info("[CURRENT] Adding connection from stream {} to kernel {}", src_stream_idx, dst_kernel_idx);
@@ -86,6 +503,7 @@ void Map::add_connection(Stream *src, Kernel *dst, std::string dst_in) {
 void Map::add_connection(Kernel *src, std::string src_out, Stream *dst) {
     auto src_kernel_idx = get_kernel_index(src);
     auto dst_stream_idx = get_stream_index(dst);
+    assert(src->get_output_port(src_out).data_format == dst->data_format && "Port and stream must have the same data format!");
     Endpoint src_endpoint = {Endpoint::EndpointType::Kernel, src_kernel_idx, src_out};
     Endpoint dst_endpoint = {Endpoint::EndpointType::Stream, dst_stream_idx, ""};
     tt::log_info("[CURRENT] Adding connection from kernel {} to stream {}", src_kernel_idx, dst_stream_idx);
@@ -93,287 +511,2349 @@ void Map::add_connection(Kernel *src, std::string src_out, Stream *dst) {
     add_connection(src_endpoint, dst_endpoint);
 }
 
-void Map::execute() {
-    check_connections();
+Session::Session(int device_id, size_t trace_region_size) : device_id(device_id), trace_region_size(trace_region_size) {
+    device = tt_metal::CreateDevice(device_id, 1, DEFAULT_L1_SMALL_SIZE, trace_region_size);
+    if (!device) {
+        std::cerr << "Failed to create device!\n";
+        exit(1);
+    }
+    tt::log_info("[CURRENT] Opened device {}", device_id);
+}
+
+Session::~Session() {
+    // Programs (and the traces of them) have to go before the device does.
+    while (!captured_maps.empty()) {
+        captured_maps.back()->release_capture();
+    }
+    program_cache.clear();
+    tt_metal::CloseDevice(device);
+    tt::log_info("[CURRENT] Closed device {}", device_id);
+}
+
+const Session::CachedProgram *Session::find_program(const std::string& signature) const {
+    auto it = program_cache.find(signature);
+    return it != program_cache.end() ? &it->second : nullptr;
+}
+
+void Session::cache_program(const std::string& signature, CachedProgram program) {
+    program_cache[signature] = std::move(program);
+}
+
+void Map::execute() {
+    // No session given, so the device only lives for this one execution.
+    assert(!capture && "Captured maps need a session that outlives the capture!");
+    Session session(0);
+    execute(session);
+    // Programs and buffers have to go before the device does, and that's when session goes out of scope.
+    runtime.program.reset();
+    runtime.profile_buffer.reset();
+    runtime.gather_scratch.reset();
+    runtime.watchdog_buffer.reset();
+    runtime.device = nullptr;
+    for (auto stream : streams) {
+        stream->device_buffer.reset();
+    }
+    for (auto stream : backing_streams()) {
+        stream->device_buffer.reset();
+    }
+}
+
+void Map::execute(Session& session) {
+    auto execution = execute_async(session);
+    if (!watchdog) {
+        execution.wait();
+    } else if (!watch(execution)) {
+        // Nothing short of a device reset gets the cores unstuck.
+        tt::log_error("[CURRENT] Map hung, the device needs a reset");
+        exit(1);
+    }
+    if (profiling) {
+        collect_profile();
+    }
+}
+
+void Map::set_capture(bool enable) {
+    if (!enable) {
+        release_capture();
+    }
+    capture = enable;
+}
+
+Execution Map::execute_async(Session& session) {
+    // Everything but the data is frozen while captured, so replays skip straight to moving data.
+    bool replay = captured.has_value();
+    if (replay) {
+        assert(captured->session == &session && "Captured maps can only be replayed on the session they were captured on!");
+    } else {
+        check_connections();
+        for (const auto stream : streams) {
+            assert(!stream->producer && !stream->consumer && "Chunked streams can only be run with execute_streaming()!");
+        }
+        runtime.device = session.get_device();
+    }
+
+    // When timing phases, drain the queue at the end of each phase so it can be measured on its own.
+    PhaseTimings timings = {};
+    auto phase_start = std::chrono::steady_clock::now();
+    auto end_phase = [&](double& seconds, bool sync) {
+        if (!phase_timing) {
+            return;
+        }
+        if (sync) {
+            tt_metal::Finish(session.command_queue());
+        }
+        auto now = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(now - phase_start).count();
+        phase_start = now;
+    };
+
+    if (replay) {
+        write_source_streams(session);
+        if (watchdog) {
+            reset_watchdog(session);
+        }
+        end_phase(timings.host_to_device_seconds, true);
+        end_phase(timings.setup_seconds, false);
+        if (captured->trace_id) {
+            tt_metal::ReplayTrace(runtime.device, session.command_queue().id(), *captured->trace_id, false);
+        } else {
+            tt_metal::EnqueueProgram(session.command_queue(), *runtime.program, false);
+        }
+        end_phase(timings.program_seconds, true);
+    } else {
+        // 1. Input & Output DRAM buffer setup.
+        setup_stream_buffers(session);
+        end_phase(timings.host_to_device_seconds, true);
+
+        // 2. Core grid setup and kernel placement. Needs to know where the buffers ended up.
+        setup_cores();
+        if (profiling) {
+            setup_profile_buffer();
+        }
+        if (watchdog) {
+            setup_watchdog_buffer();
+            reset_watchdog(session);
+        }
+        if (max_gather_ports() > 0) {
+            setup_gather_scratch();
+        }
+
+        // 3. Build the program, or reuse one we've already compiled for an identical map.
+        // Maps being captured get a program of their own, since another map restoring it would overwrite its runtime args.
+        auto signature = program_signature();
+        auto cached = capture ? nullptr : session.find_program(signature);
+        if (cached) {
+            tt::log_info("[CURRENT] Program cache hit ({:x}), skipping kernel generation", std::hash<std::string>{}(signature));
+            restore_program(*cached);
+        } else {
+            tt::log_info("[CURRENT] Program cache miss ({:x}), building program", std::hash<std::string>{}(signature));
+            generate_device_kernels();
+            build_program();
+            if (!capture) {
+                session.cache_program(signature, snapshot_program());
+            }
+        }
+
+        // 4. Sharded streams go into the L1 of the cores the program was built for.
+        // Runtime args change every execution (buffer addresses), so always set them.
+        setup_sharded_stream_buffers(session);
+        set_runtime_args();
+        end_phase(timings.setup_seconds, false);
+
+        // Everything goes on the command queue without blocking. The queue executes in order,
+        // so the writes land before the program runs and the read happens after it finishes.
+        tt_metal::EnqueueProgram(session.command_queue(), *runtime.program, false);
+        end_phase(timings.program_seconds, true);
+        if (capture) {
+            capture_program(session);
+        }
+    }
+
+    // Read every sink the user wants back straight into its host data, unless the host data can't hold the whole last tile.
+    std::vector<Execution::PartialRead> partial_reads;
+    for (size_t i = 0; i < streams.size(); i++) {
+        auto stream = streams[i];
+        if (!is_sink_stream(i) || !stream->read_back) {
+            continue;
+        }
+        if (stream->host_data.size() < stream->device_words()) {
+            // Moving the staging vector along with partial_reads keeps its storage where the read lands.
+            auto& partial = partial_reads.emplace_back(Execution::PartialRead{std::vector<uint32_t>(stream->device_words()), stream->host_data});
+            tt_metal::EnqueueReadBuffer(session.command_queue(), stream->device_buffer, partial.staging.data(), false);
+        } else {
+            tt_metal::EnqueueReadBuffer(session.command_queue(), stream->device_buffer, stream->host_data.data(), false);
+        }
+    }
+    end_phase(timings.device_to_host_seconds, true);
+    if (phase_timing) {
+        phase_timings = timings;
+    }
+
+    Execution execution;
+    execution.event = std::make_shared<tt_metal::Event>();
+    tt_metal::EnqueueRecordEvent(session.command_queue(), execution.event);
+    execution.partial_reads = std::move(partial_reads);
+    // Keep this execution's buffers alive until it finishes, even if the streams get new ones in the meantime.
+    for (const auto stream : streams) {
+        execution.buffers.push_back(stream->device_buffer);
+    }
+    for (const auto stream : backing_streams()) {
+        execution.buffers.push_back(stream->device_buffer);
+    }
+    if (profiling) {
+        execution.buffers.push_back(runtime.profile_buffer);
+    }
+    if (runtime.gather_scratch) {
+        execution.buffers.push_back(runtime.gather_scratch);
+    }
+    if (watchdog) {
+        execution.buffers.push_back(runtime.watchdog_buffer);
+    }
+    return execution;
+}
+
+void Map::execute_streaming(Session& session, uint32_t chunk_tiles) {
+    assert(chunk_tiles > 0 && "Chunk size must be non-zero!");
+    assert(!streams.empty() && "Streaming needs at least one stream!");
+    assert(!captured && "Captured maps can only be replayed with execute_async()!");
+    assert(!watchdog && "The watchdog only watches execute() and execute_async()!");
+    check_connections();
+    runtime.device = session.get_device();
+    // Every window moves the same slice of every stream, so they all have to be the same size.
+    uint32_t total_tiles = streams[0]->n_tiles;
+    for (auto stream : streams) {
+        assert(stream->n_tiles == total_tiles && "Streaming needs every stream to have the same # of tiles!");
+        assert(stream->memory == Stream::Memory::Dram && "Streaming goes through DRAM chunks, streams can't be in L1!");
+        assert(!stream->is_view() && "Streaming goes through DRAM chunks, streams can't be views!");
+    }
+    uint32_t n_windows = (total_tiles + chunk_tiles - 1) / chunk_tiles;
+    tt::log_info("[CURRENT] Streaming {} tiles in {} windows of {} tiles", total_tiles, n_windows, chunk_tiles);
+
+    // Tile counts get baked into the kernels (N_TILES, FULL_BATCHES), so a partial last window needs its own program.
+    // The window is part of the program signature, so each one gets its own cache entry.
+    auto load_program = [&](uint32_t tiles) {
+        window_tiles = tiles;
+        setup_cores();
+        auto signature = program_signature();
+        auto cached = session.find_program(signature);
+        if (cached) {
+            restore_program(*cached);
+        } else {
+            generate_device_kernels();
+            build_program();
+            session.cache_program(signature, snapshot_program());
+        }
+    };
+
+    // Every stream gets a ring of two DRAM chunks (plus host staging for the streamed ones),
+    // so window k+1 can be set up while window k is still in flight.
+    for (auto stream : streams) {
+        uint32_t tile_size_bytes = stream->tile_size_bytes;
+        for (size_t slot = 0; slot < 2; slot++) {
+            tt_metal::InterleavedBufferConfig config = {
+                .device = runtime.device,
+                .size = chunk_tiles * tile_size_bytes,
+                .page_size = tile_size_bytes,
+                .buffer_type = tt_metal::BufferType::DRAM
+            };
+            stream->chunk_buffers[slot] = tt_metal::CreateBuffer(config);
+            stream->chunk_staging[slot].resize(chunk_tiles * tile_size_bytes / sizeof(uint32_t));
+        }
+        stream->device_buffer_noc_coordinates = stream->chunk_buffers[0]->noc_coordinates();
+    }
+    if (profiling) {
+        // Every window overwrites the counters, so a profile collected afterwards covers the last window.
+        setup_profile_buffer();
+        tt::log_info("[CURRENT] Profiling a streamed map only reports the last window");
+    }
+    load_program(chunk_tiles);
+
+    // Hand a finished window's sink data over to the user.
+    auto drain = [&](uint32_t window) {
+        uint32_t slot = window % 2;
+        uint32_t first_tile = window * chunk_tiles;
+        uint32_t tiles = std::min(chunk_tiles, total_tiles - first_tile);
+        for (size_t i = 0; i < streams.size(); i++) {
+            auto stream = streams[i];
+            if (!is_sink_stream(i) || !stream->read_back) {
+                continue;
+            }
+            size_t tile_words = stream->tile_size_bytes / sizeof(uint32_t);
+            std::span<const uint32_t> chunk(stream->chunk_staging[slot].data(), tiles * tile_words);
+            if (stream->consumer) {
+                stream->consumer(chunk, first_tile);
+            } else {
+                size_t offset = first_tile * tile_words;
+                std::copy_n(chunk.begin(), std::min(chunk.size(), stream->host_data.size() - offset), stream->host_data.begin() + offset);
+            }
+        }
+    };
+
+    std::array<std::shared_ptr<tt_metal::Event>, 2> slot_events;
+    for (uint32_t window = 0; window < n_windows; window++) {
+        uint32_t slot = window % 2;
+        uint32_t first_tile = window * chunk_tiles;
+        uint32_t tiles = std::min(chunk_tiles, total_tiles - first_tile);
+
+        // The window that last used this slot has to be done before we touch its staging buffers.
+        if (slot_events[slot]) {
+            tt_metal::EventSynchronize(slot_events[slot]);
+            drain(window - 2);
+        }
+
+        // Fill the source chunks. The host does this while the device is still working on the previous window.
+        for (size_t i = 0; i < streams.size(); i++) {
+            auto stream = streams[i];
+            stream->device_buffer = stream->chunk_buffers[slot];
+            stream->device_buffer_address = stream->device_buffer->address();
+            stream->device_buffer_noc_coordinates = stream->device_buffer->noc_coordinates();
+            if (!is_source_stream(i)) {
+                continue;
+            }
+            size_t tile_words = stream->tile_size_bytes / sizeof(uint32_t);
+            std::span<uint32_t> chunk(stream->chunk_staging[slot].data(), tiles * tile_words);
+            if (stream->producer) {
+                stream->producer(chunk, first_tile);
+            } else {
+                // The staging is reused across windows, so padding past the end of the host data gets zeroed.
+                size_t offset = first_tile * tile_words;
+                size_t words = std::min(chunk.size(), stream->host_data.size() - offset);
+                std::copy_n(stream->host_data.begin() + offset, words, chunk.begin());
+                std::fill(chunk.begin() + words, chunk.end(), 0);
+            }
+            tt_metal::EnqueueWriteBuffer(session.command_queue(), stream->device_buffer, stream->chunk_staging[slot].data(), false);
+        }
+
+        // Only the last window can be partial. The full window's program stays alive in the session's cache.
+        if (tiles != chunk_tiles) {
+            load_program(tiles);
+        }
+        set_runtime_args();
+        tt_metal::EnqueueProgram(session.command_queue(), *runtime.program, false);
+        for (size_t i = 0; i < streams.size(); i++) {
+            if (is_sink_stream(i) && streams[i]->read_back) {
+                tt_metal::EnqueueReadBuffer(session.command_queue(), streams[i]->device_buffer, streams[i]->chunk_staging[slot].data(), false);
+            }
+        }
+        slot_events[slot] = std::make_shared<tt_metal::Event>();
+        tt_metal::EnqueueRecordEvent(session.command_queue(), slot_events[slot]);
+    }
+
+    // Drain whatever is still in flight.
+    for (uint32_t window = (n_windows >= 2 ? n_windows - 2 : 0); window < n_windows; window++) {
+        tt_metal::EventSynchronize(slot_events[window % 2]);
+        drain(window);
+    }
+    tt::log_info("[CURRENT] Streaming execution completed!");
+
+    // Only the window's worth of memory was needed, give it back.
+    window_tiles.reset();
+    for (auto stream : streams) {
+        stream->device_buffer.reset();
+        for (size_t slot = 0; slot < 2; slot++) {
+            stream->chunk_buffers[slot].reset();
+            stream->chunk_staging[slot] = {};
+        }
+    }
+}
+
+void Map::execute_data_parallel(const std::vector<Session *>& sessions) {
+    assert(!sessions.empty() && "Need at least one session!");
+    assert(!streams.empty() && "Data parallel execution needs at least one stream!");
+    assert(!captured && "Captured maps can only be replayed with execute_async()!");
+    assert(!watchdog && "The watchdog only watches execute() and execute_async()!");
+    check_connections();
+    // Like streaming, every device moves the same slice of every stream, so they all have to be the same size.
+    uint32_t total_tiles = streams[0]->n_tiles;
+    for (auto stream : streams) {
+        assert(!stream->producer && !stream->consumer && "Chunked streams can only be run with execute_streaming()!");
+        assert(stream->n_tiles == total_tiles && "Data parallel execution needs every stream to have the same # of tiles!");
+        assert(stream->memory == Stream::Memory::Dram && "Data parallel execution splits streams in DRAM, streams can't be in L1!");
+        assert(!stream->is_view() && "Data parallel execution splits streams in DRAM, streams can't be views!");
+    }
+    // Slices are whole batches (all but the last), and devices that would get nothing sit this one out.
+    uint32_t n_batches = std::max<uint32_t>(1, (total_tiles + tiles_per_batch - 1) / tiles_per_batch);
+    uint32_t slice_batches = (n_batches + sessions.size() - 1) / sessions.size();
+    uint32_t slice_tiles = slice_batches * tiles_per_batch;
+    uint32_t n_devices = (n_batches + slice_batches - 1) / slice_batches;
+    tt::log_info("[CURRENT] Splitting {} tiles across {} devices, {} tiles each", total_tiles, n_devices, slice_tiles);
+    if (profiling) {
+        tt::log_info("[CURRENT] Profiling a data parallel map only reports the last device");
+    }
+
+    // What has to stay alive until a device is done with its slice.
+    struct Slice {
+        std::shared_ptr<tt_metal::Program> program;
+        std::vector<std::shared_ptr<tt_metal::Buffer>> buffers;
+        std::vector<std::vector<uint32_t>> staging; // Per stream, for sinks and for sources ending in a partial tile.
+        std::shared_ptr<tt_metal::Event> event;
+    };
+    std::vector<Slice> slices(n_devices);
+    for (uint32_t d = 0; d < n_devices; d++) {
+        auto& session = *sessions[d];
+        auto& slice = slices[d];
+        uint32_t first_tile = d * slice_tiles;
+        uint32_t tiles = std::min(slice_tiles, total_tiles - first_tile);
+        runtime.device = session.get_device();
+        window_tiles = tiles;
+
+        // Buffers for this device's slice. Non-blocking, so the devices set up earlier are already running.
+        slice.staging.resize(streams.size());
+        for (size_t i = 0; i < streams.size(); i++) {
+            auto stream = streams[i];
+            tt_metal::InterleavedBufferConfig config = {
+                .device = runtime.device,
+                .size = tiles * stream->tile_size_bytes,
+                .page_size = stream->tile_size_bytes,
+                .buffer_type = tt_metal::BufferType::DRAM
+            };
+            stream->device_buffer = tt_metal::CreateBuffer(config);
+            stream->device_buffer_address = stream->device_buffer->address();
+            stream->device_buffer_noc_coordinates = stream->device_buffer->noc_coordinates();
+            slice.buffers.push_back(stream->device_buffer);
+            size_t tile_words = stream->tile_size_bytes / sizeof(uint32_t);
+            size_t offset = first_tile * tile_words;
+            if (is_source_stream(i)) {
+                const uint32_t *data = stream->host_data.data() + offset;
+                if (offset + tiles * tile_words > stream->host_data.size()) {
+                    // The host data stops short of the last tile, pad it out.
+                    slice.staging[i].assign(stream->host_data.begin() + offset, stream->host_data.end());
+                    slice.staging[i].resize(tiles * tile_words, 0);
+                    data = slice.staging[i].data();
+                }
+                tt_metal::EnqueueWriteBuffer(session.command_queue(), stream->device_buffer, data, false);
+            } else if (is_sink_stream(i) && stream->read_back) {
+                slice.staging[i].resize(tiles * tile_words);
+            }
+        }
+
+        // Every device gets its own placement and program, from its own session's cache.
+        setup_cores();
+        if (profiling) {
+            setup_profile_buffer();
+            slice.buffers.push_back(runtime.profile_buffer);
+        }
+        auto signature = program_signature();
+        auto cached = session.find_program(signature);
+        if (cached) {
+            restore_program(*cached);
+        } else {
+            generate_device_kernels();
+            build_program();
+            session.cache_program(signature, snapshot_program());
+        }
+        set_runtime_args();
+        tt_metal::EnqueueProgram(session.command_queue(), *runtime.program, false);
+        slice.program = runtime.program;
+        for (size_t i = 0; i < streams.size(); i++) {
+            if (is_sink_stream(i) && streams[i]->read_back) {
+                tt_metal::EnqueueReadBuffer(session.command_queue(), streams[i]->device_buffer, slice.staging[i].data(), false);
+            }
+        }
+        slice.event = std::make_shared<tt_metal::Event>();
+        tt_metal::EnqueueRecordEvent(session.command_queue(), slice.event);
+    }
+
+    // Gather every device's slice of the sinks back into the sinks' host data.
+    for (uint32_t d = 0; d < n_devices; d++) {
+        tt_metal::EventSynchronize(slices[d].event);
+        for (size_t i = 0; i < streams.size(); i++) {
+            auto stream = streams[i];
+            if (!is_sink_stream(i) || !stream->read_back) {
+                continue;
+            }
+            size_t offset = d * slice_tiles * (stream->tile_size_bytes / sizeof(uint32_t));
+            size_t words = std::min(slices[d].staging[i].size(), stream->host_data.size() - offset);
+            std::copy_n(slices[d].staging[i].begin(), words, stream->host_data.begin() + offset);
+        }
+    }
+    tt::log_info("[CURRENT] Data parallel execution completed!");
+
+    window_tiles.reset();
+    for (auto stream : streams) {
+        stream->device_buffer.reset();
+    }
+}
+
+void Execution::wait() {
+    if (!done) {
+        tt_metal::EventSynchronize(event);
+        finish();
+    }
+}
+
+bool Execution::is_done() {
+    if (!done && tt_metal::EventQuery(event)) {
+        finish();
+    }
+    return done;
+}
+
+void Execution::finish() {
+    tt::log_info("[CURRENT] Program execution completed!");
+    for (const auto& partial : partial_reads) {
+        std::copy_n(partial.staging.begin(), partial.host_data.size(), partial.host_data.begin());
+    }
+    partial_reads.clear();
+    buffers.clear();
+    done = true;
+}
+
+void Map::setup_cores() {
+    // Core grid setup.
+    // TODO: Have this configurable by user and dyanmic by runtime scheduling.
+    // Right now each kernel gets as many cores as it has replicas.
+    auto compute_with_storage_grid_size = runtime.device->compute_with_storage_grid_size();
+    runtime.num_cores_x = compute_with_storage_grid_size.x;
+    runtime.num_cores_y = compute_with_storage_grid_size.y;
+    uint32_t grid_cores = runtime.num_cores_x * runtime.num_cores_y;
+    resolve_replicas(grid_cores);
+    runtime.num_cores = 0;
+    for (const auto kernel : kernels) {
+        runtime.num_cores += kernel->num_replicas;
+    }
+    tt::log_info("[CURRENT] num_cores_x: {}, num_cores_y: {}", runtime.num_cores_x, runtime.num_cores_y);
+    tt::log_info("[CURRENT] Total cores: {}", runtime.num_cores);
+    runtime.l1_budget = cb_l1_budget != 0 ? cb_l1_budget : runtime.device->l1_size_per_core() - L1_RESERVED_BYTES - l1_stream_bytes_per_core();
+
+    // Vector of cores we have availible to assign to kernels. The placement engine gets to pick from the
+    // whole grid, sequential placement just takes the first ones.
+    std::vector<CoreCoord> cores;
+    for (const CoreRange& range : num_cores_to_corerange_set({0, 0}, grid_cores, {runtime.num_cores_x, runtime.num_cores_y})) {
+        for (const CoreCoord& core : range) {
+            cores.push_back(core);
+        }
+    }
+
+    // Each replica of a kernel gets mapped to a single core.
+    // NOTE: This also requires that we need as many cores as kernel replicas.
+    if (placement == Placement::Sequential) {
+        size_t next_core = 0;
+        for (auto kernel : kernels) {
+            kernel->replica_cores.assign(cores.begin() + next_core, cores.begin() + next_core + kernel->num_replicas);
+            next_core += kernel->num_replicas;
+        }
+    } else {
+        place_kernels(cores);
+    }
+
+    runtime.core_set.clear();
+    for (size_t i = 0; i < kernels.size(); i++) {
+        auto kernel = kernels[i];
+        std::set<CoreRange> ranges;
+        for (const auto& core : kernel->replica_cores) {
+            ranges.insert(CoreRange(core, core));
+            runtime.core_set.insert(CoreRange(core, core));
+        }
+        kernel->core_spec = CoreRangeSet(ranges);
+        tt::log_info("[CURRENT] Kernel {} replicated across {} cores", i, kernel->num_replicas);
+    }
+    tt::log_info("[CURRENT] core_set: {}", runtime.core_set);
+}
+
+void Map::place_kernels(const std::vector<CoreCoord>& cores) {
+    // Placement is done on physical NoC coordinates, where the hop count between two nodes
+    // is roughly their manhattan distance.
+    std::vector<CoreCoord> physical_cores;
+    for (const auto& core : cores) {
+        physical_cores.push_back(runtime.device->worker_core_from_logical_core(core));
+    }
+    auto hops = [](const CoreCoord& a, const CoreCoord& b) -> uint64_t {
+        return (a.x > b.x ? a.x - b.x : b.x - a.x) + (a.y > b.y ? a.y - b.y : b.y - a.y);
+    };
+
+    // Every replica is a slot that needs a core. Slots are linked to the slots they exchange tiles with,
+    // and to the DRAM banks of the streams they read or write, weighted by the # of bytes moved.
+    // NOTE: Interleaved buffers are spread over every bank, so the buffer's first bank is only an approximation.
+    struct Link {
+        int slot;              // Other slot, or -1 if this is a link to DRAM.
+        CoreCoord dram_core;   // Physical coordinates of the DRAM bank, if slot == -1.
+        uint64_t weight;       // Bytes moved over this link.
+    };
+    std::vector<std::pair<size_t, uint32_t>> slots; // (kernel index, replica)
+    std::vector<size_t> first_slot(kernels.size());
+    for (size_t k = 0; k < kernels.size(); k++) {
+        first_slot[k] = slots.size();
+        for (uint32_t r = 0; r < kernels[k]->num_replicas; r++) {
+            slots.push_back({k, r});
+        }
+    }
+    std::vector<std::vector<Link>> links(slots.size());
+    for (const auto& connection : connections) {
+        size_t k = connection.source.is_kernel() ? connection.source.index : connection.dest.index;
+        auto kernel = kernels[k];
+        auto port_format = connection.source.is_kernel()
+            ? kernel->get_output_port(connection.source.port).data_format
+            : kernel->get_input_port(connection.dest.port).data_format;
+        uint64_t tile_size_bytes = tile_size_in_bytes(port_format);
+        if (connection.source.is_kernel() && connection.dest.is_kernel()) {
+            // Replica i of the side with more replicas talks to replica i % n of the other side.
+            uint32_t src_replicas = kernels[connection.source.index]->num_replicas;
+            uint32_t dst_replicas = kernels[connection.dest.index]->num_replicas;
+            uint32_t n = std::max(src_replicas, dst_replicas);
+            for (uint32_t r = 0; r < n; r++) {
+                uint64_t weight = replica_n_tiles(get_n_tiles(connection), port_batch_tiles(connection_port(connection)), n, r) * tile_size_bytes;
+                int src = first_slot[connection.source.index] + r % src_replicas;
+                int dst = first_slot[connection.dest.index] + r % dst_replicas;
+                links[src].push_back({dst, {}, weight});
+                links[dst].push_back({src, {}, weight});
+            }
+        } else if (auto leader = shared_stream_leader(connection)) {
+            // Forwarded by the leader, so this replica talks to the leader's replicas instead of DRAM.
+            uint32_t src_replicas = kernels[leader->dest.index]->num_replicas;
+            uint32_t n = std::max(src_replicas, kernel->num_replicas);
+            for (uint32_t r = 0; r < n; r++) {
+                uint64_t weight = replica_n_tiles(get_n_tiles(connection), port_batch_tiles(connection_port(connection)), n, r) * tile_size_bytes;
+                int src = first_slot[leader->dest.index] + r % src_replicas;
+                int dst = first_slot[k] + r % kernel->num_replicas;
+                links[src].push_back({dst, {}, weight});
+                links[dst].push_back({src, {}, weight});
+            }
+        } else {
+            auto stream = streams[connection.source.is_stream() ? connection.source.index : connection.dest.index];
+            // L1 streams are spread over every core and sharded ones are local, neither pulls a replica anywhere.
+            if (stream->memory != Stream::Memory::Dram) {
+                continue;
+            }
+            for (uint32_t r = 0; r < kernel->num_replicas; r++) {
+                uint64_t weight = replica_n_tiles(get_n_tiles(connection), port_batch_tiles(connection_port(connection)), kernel->num_replicas, r) * tile_size_bytes;
+                links[first_slot[k] + r].push_back({-1, stream->device_buffer_noc_coordinates, weight});
+            }
+        }
+    }
+
+    // assignment[slot] is an index into cores, or -1 while unplaced.
+    std::vector<int> assignment(slots.size(), -1);
+    std::vector<bool> used(cores.size(), false);
+    // Cost of a slot sitting on a core, against the slots that have already been placed.
+    auto slot_cost = [&](size_t slot, size_t core) {
+        uint64_t cost = 0;
+        for (const auto& link : links[slot]) {
+            if (link.slot < 0) {
+                cost += link.weight * hops(physical_cores[core], link.dram_core);
+            } else if (assignment[link.slot] >= 0) {
+                cost += link.weight * hops(physical_cores[core], physical_cores[assignment[link.slot]]);
+            }
+        }
+        return cost;
+    };
+
+    // Greedy: place kernels in topological order (so producers are placed before their consumers),
+    // putting each replica on the free core that's cheapest given what's already been placed.
+    for (size_t k : topological_order()) {
+        for (uint32_t r = 0; r < kernels[k]->num_replicas; r++) {
+            size_t slot = first_slot[k] + r;
+            size_t best = cores.size();
+            uint64_t best_cost = 0;
+            for (size_t c = 0; c < cores.size(); c++) {
+                if (used[c]) {
+                    continue;
+                }
+                uint64_t cost = slot_cost(slot, c);
+                if (best == cores.size() || cost < best_cost) {
+                    best = c;
+                    best_cost = cost;
+                }
+            }
+            assert(best != cores.size() && "Not enough cores for all kernel replicas!");
+            assignment[slot] = best;
+            used[best] = true;
+        }
+    }
+
+    // Search: local search from the greedy placement, moving replicas to free cores or swapping two
+    // replicas whenever it lowers the total weighted hop count, until nothing improves.
+    if (placement == Placement::Search) {
+        std::vector<int> occupant(cores.size(), -1);
+        for (size_t slot = 0; slot < slots.size(); slot++) {
+            occupant[assignment[slot]] = slot;
+        }
+        bool improved = true;
+        for (uint32_t pass = 0; improved && pass < MAX_PLACEMENT_SEARCH_PASSES; pass++) {
+            improved = false;
+            for (size_t slot = 0; slot < slots.size(); slot++) {
+                for (size_t c = 0; c < cores.size(); c++) {
+                    size_t current = assignment[slot];
+                    if (c == current) {
+                        continue;
+                    }
+                    int other = occupant[c];
+                    uint64_t before = slot_cost(slot, current) + (other >= 0 ? slot_cost(other, c) : 0);
+                    assignment[slot] = c;
+                    if (other >= 0) {
+                        assignment[other] = current;
+                    }
+                    uint64_t after = slot_cost(slot, c) + (other >= 0 ? slot_cost(other, current) : 0);
+                    if (after < before) {
+                        occupant[c] = slot;
+                        occupant[current] = other;
+                        improved = true;
+                    } else {
+                        assignment[slot] = current;
+                        if (other >= 0) {
+                            assignment[other] = c;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    uint64_t total_cost = 0;
+    for (size_t slot = 0; slot < slots.size(); slot++) {
+        total_cost += slot_cost(slot, assignment[slot]);
+        auto [k, r] = slots[slot];
+        if (r == 0) {
+            kernels[k]->replica_cores.clear();
+        }
+        kernels[k]->replica_cores.push_back(cores[assignment[slot]]);
+    }
+    tt::log_info("[CURRENT] Placement cost: {} byte-hops", total_cost);
+}
+
+void Map::order_graph() const {
+    if (graph.ordered) {
+        return;
+    }
+    // Kahn's algorithm over the kernel -> kernel connections.
+    std::vector<size_t> in_degree(kernels.size(), 0);
+    for (size_t k = 0; k < kernels.size(); k++) {
+        for (size_t c : graph.incoming[k]) {
+            in_degree[k] += connections[c].source.is_kernel();
+        }
+    }
+    auto& order = graph.order;
+    order.clear();
+    for (size_t k = 0; k < kernels.size(); k++) {
+        if (in_degree[k] == 0) {
+            order.push_back(k);
+        }
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        for (size_t c : graph.outgoing[order[i]]) {
+            if (connections[c].dest.is_kernel() && --in_degree[connections[c].dest.index] == 0) {
+                order.push_back(connections[c].dest.index);
+            }
+        }
+    }
+    // Kernels on a cycle are ranked after everything else.
+    graph.rank.assign(kernels.size(), kernels.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        graph.rank[order[i]] = i;
+    }
+    graph.ordered = true;
+}
+
+const std::vector<size_t>& Map::topological_order() const {
+    order_graph();
+    assert(graph.order.size() == kernels.size() && "Kernel graph has a cycle!");
+    return graph.order;
+}
+
+void Map::setup_profile_buffer() {
+    // One page per L1 bank, so every core gets the same scratch address and the allocator keeps CBs out of it.
+    uint32_t page_size = PROFILE_RECORDS_PER_CORE * PROFILE_RECORD_BYTES;
+    tt_metal::InterleavedBufferConfig config = {
+        .device = runtime.device,
+        .size = page_size * runtime.device->num_banks(tt_metal::BufferType::L1),
+        .page_size = page_size,
+        .buffer_type = tt_metal::BufferType::L1
+    };
+    runtime.profile_buffer = tt_metal::CreateBuffer(config);
+}
+
+const ProfileReport& Map::collect_profile() {
+    assert(profiling && runtime.profile_buffer && "Map wasn't executed with profiling enabled!");
+    ProfileReport report;
+    report.clock_mhz = tt::Cluster::instance().get_device_aiclk(runtime.device->id());
+    auto pct = [](uint64_t part, uint64_t total) { return total != 0 ? 100.0 * part / total : 0.0; };
+
+    for (size_t i = 0; i < kernels.size(); i++) {
+        auto kernel = kernels[i];
+        auto incoming_connections = get_incoming_connections(kernel);
+        auto outgoing_connections = get_outgoing_connections(kernel);
+
+        // Counters of the reader, compute and writer records, summed over replicas.
+        std::array<std::array<uint64_t, PROFILE_COUNTERS>, PROFILE_RECORDS_PER_CORE> sums = {};
+        uint64_t cycles = 0;
+        for (const auto& core : kernel->replica_cores) {
+            std::vector<uint32_t> words;
+            tt_metal::detail::ReadFromDeviceL1(runtime.device, core, runtime.profile_buffer->address(), PROFILE_RECORDS_PER_CORE * PROFILE_RECORD_BYTES, words);
+            for (size_t r = 0; r < PROFILE_RECORDS_PER_CORE; r++) {
+                for (size_t c = 0; c < PROFILE_COUNTERS; c++) {
+                    size_t w = (r * PROFILE_COUNTERS + c) * 2;
+                    uint64_t value = words[w] | ((uint64_t)words[w + 1] << 32);
+                    sums[r][c] += value;
+                    if (c == 0) {
+                        cycles = std::max(cycles, value);
+                    }
+                }
+            }
+        }
+        auto& reader = sums[0];
+        auto& compute = sums[1];
+        auto& writer = sums[2];
+
+        ProfileReport::KernelProfile kernel_profile;
+        kernel_profile.replicas = kernel->num_replicas;
+        kernel_profile.cycles = cycles;
+        kernel_profile.seconds = cycles / (report.clock_mhz * 1e6);
+        kernel_profile.read_barrier_pct = pct(reader[1], reader[0]);
+        kernel_profile.write_barrier_pct = pct(writer[1], writer[0]);
+        double seconds = kernel_profile.seconds;
+        auto port_profile = [&](const std::string& name, tt::DataFormat data_format, uint32_t tiles) {
+            ProfileReport::PortProfile stats;
+            stats.name = name;
+            stats.tiles = tiles;
+            stats.bytes = (uint64_t)tiles * tile_size_in_bytes(data_format);
+            stats.tiles_per_second = seconds > 0 ? tiles / seconds : 0.0;
+            return stats;
+        };
+        // Inputs are filled by the reader and drained by compute, outputs are filled by compute and drained by the writer.
+        for (size_t p = 0; p < incoming_connections.size(); p++) {
+            auto port = kernel->get_input_port(incoming_connections[p].dest.port);
+            auto stats = port_profile(port.name, port.data_format, get_n_tiles(incoming_connections[p]));
+            stats.full_stall_pct = pct(reader[2 + 2 * p], reader[0]);
+            stats.empty_stall_pct = pct(compute[2 + 2 * p], compute[0]);
+            stats.noc_wait_pct = pct(reader[3 + 2 * p], reader[0]);
+            kernel_profile.inputs.push_back(stats);
+        }
+        for (size_t p = 0; p < outgoing_connections.size(); p++) {
+            auto port = kernel->get_output_port(outgoing_connections[p].source.port);
+            auto stats = port_profile(port.name, port.data_format, get_n_tiles(outgoing_connections[p]));
+            stats.full_stall_pct = pct(compute[3 + 2 * p], compute[0]);
+            stats.empty_stall_pct = pct(writer[2 + 2 * p], writer[0]);
+            stats.noc_wait_pct = pct(writer[3 + 2 * p], writer[0]);
+            kernel_profile.outputs.push_back(stats);
+        }
+        tt::log_info("[CURRENT] Kernel {}: {} cycles, read barrier {:.1f}%, write barrier {:.1f}%",
+                     i, kernel_profile.cycles, kernel_profile.read_barrier_pct, kernel_profile.write_barrier_pct);
+        report.kernels.push_back(kernel_profile);
+    }
+    profile = report;
+    return *profile;
+}
+
+void Map::export_profile_json(const std::string& filename) const {
+    assert(profile && "No profile collected yet!");
+    std::ofstream json_file(filename);
+    if (!json_file.is_open()) {
+        tt::log_error("[CURRENT] Failed to open file for writing: {}", filename);
+        exit(1);
+    }
+    auto write_ports = [&](const std::vector<ProfileReport::PortProfile>& ports) {
+        json_file << "[";
+        for (size_t p = 0; p < ports.size(); p++) {
+            const auto& port = ports[p];
+            json_file << (p ? ", " : "") << "{\"name\": \"" << port.name << "\", \"tiles\": " << port.tiles
+                      << ", \"bytes\": " << port.bytes << ", \"tiles_per_second\": " << port.tiles_per_second
+                      << ", \"full_stall_pct\": " << port.full_stall_pct << ", \"empty_stall_pct\": " << port.empty_stall_pct
+                      << ", \"noc_wait_pct\": " << port.noc_wait_pct << "}";
+        }
+        json_file << "]";
+    };
+    json_file << "{\n";
+    json_file << "  \"clock_mhz\": " << profile->clock_mhz << ",\n";
+    json_file << "  \"kernels\": [\n";
+    for (size_t i = 0; i < profile->kernels.size(); i++) {
+        const auto& kernel = profile->kernels[i];
+        json_file << "    {\"kernel\": " << i << ", \"replicas\": " << kernel.replicas << ", \"cycles\": " << kernel.cycles
+                  << ", \"seconds\": " << kernel.seconds << ", \"read_barrier_pct\": " << kernel.read_barrier_pct
+                  << ", \"write_barrier_pct\": " << kernel.write_barrier_pct << ",\n";
+        json_file << "     \"inputs\": ";
+        write_ports(kernel.inputs);
+        json_file << ",\n     \"outputs\": ";
+        write_ports(kernel.outputs);
+        json_file << "}" << (i + 1 < profile->kernels.size() ? "," : "") << "\n";
+    }
+    json_file << "  ]\n";
+    json_file << "}\n";
+}
+
+std::string Map::instrument_wait(const std::string& indent, const std::string& code, uint32_t counter,
+                                 WatchdogWait wait, uint32_t port, const std::string& trisc) const {
+    std::string waiting = indent + code + "\n";
+    if (profiling) {
+        waiting = indent + "prof_t = prof_cycles();\n" +
+                  waiting +
+                  indent + "prof_counters[" + std::to_string(counter) + "] += prof_cycles() - prof_t;\n";
+    }
+    if (watchdog) {
+        // Compute's packer gets a word of its own, the unpacker shares the reader/writer's.
+        std::string word = trisc == "PACK" ? "wd[2]" : "wd[1]";
+        auto publish = [&](uint32_t value) {
+            std::string store = word + " = " + std::to_string(value);
+            return indent + (trisc.empty() ? store + ";" : trisc + "((" + store + "));") + "\n";
+        };
+        waiting = publish((uint32_t)wait << 16 | port) + waiting + publish(0);
+    }
+    return waiting;
+}
+
+std::string Map::watchdog_tiles(const std::string& indent, uint32_t word, const std::string& tiles, const std::string& trisc) const {
+    if (!watchdog) {
+        return "";
+    }
+    std::string add = "wd[" + std::to_string(word) + "] += " + tiles;
+    return indent + (trisc.empty() ? add + ";" : trisc + "((" + add + "));") + "\n";
+}
+
+void Map::setup_watchdog_buffer() {
+    // Like the profile buffer, one page per L1 bank so every core gets its records at the same address.
+    uint32_t page_size = WATCHDOG_RECORDS_PER_CORE * WATCHDOG_RECORD_BYTES;
+    tt_metal::InterleavedBufferConfig config = {
+        .device = runtime.device,
+        .size = page_size * runtime.device->num_banks(tt_metal::BufferType::L1),
+        .page_size = page_size,
+        .buffer_type = tt_metal::BufferType::L1
+    };
+    runtime.watchdog_buffer = tt_metal::CreateBuffer(config);
+}
+
+void Map::reset_watchdog(Session& session) {
+    // Kernels only ever add to the tile counts, so they start out at 0 every execution.
+    std::vector<uint32_t> zeros(runtime.watchdog_buffer->size() / sizeof(uint32_t), 0);
+    tt_metal::EnqueueWriteBuffer(session.command_queue(), runtime.watchdog_buffer, zeros, false);
+    hang_report.reset();
+}
+
+std::vector<uint32_t> Map::read_watchdog_records(const CoreCoord& core) const {
+    std::vector<uint32_t> records;
+    tt_metal::detail::ReadFromDeviceL1(runtime.device, core, runtime.watchdog_buffer->address(),
+                                       WATCHDOG_RECORDS_PER_CORE * WATCHDOG_RECORD_BYTES, records);
+    return records;
+}
+
+bool Map::watch(Execution& execution) {
+    assert(watchdog && "Enable the watchdog first!");
+    // Slow isn't hung. Every record of every core is a snapshot of progress, and any change to it
+    // (a RISC starting or finishing, a tile count going up, a wait moving on) restarts the deadline.
+    auto snapshot = [&] {
+        std::vector<uint32_t> records;
+        for (const auto kernel : kernels) {
+            for (const auto& core : kernel->replica_cores) {
+                auto core_records = read_watchdog_records(core);
+                records.insert(records.end(), core_records.begin(), core_records.end());
+            }
+        }
+        return records;
+    };
+    auto progress = snapshot();
+    auto last_progress = std::chrono::steady_clock::now();
+    auto last_poll = last_progress;
+    while (!execution.is_done()) {
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - last_poll).count() >= WATCHDOG_POLL_SECONDS) {
+            last_poll = now;
+            auto records = snapshot();
+            if (records != progress) {
+                progress = std::move(records);
+                last_progress = now;
+            } else if (std::chrono::duration<double>(now - last_progress).count() > watchdog_timeout) {
+                hang_report = watchdog_report();
+                return false;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+std::string Map::watchdog_report() {
+    // A hung kernel is blocked on a CB (full: whoever drains it is stuck or too slow, empty: whoever fills it is)
+    // or on the kernel at the other end of a connection. Tile counts show how far each side of a CB got.
+    std::stringstream report;
+    auto line = [&](const std::string& text) {
+        tt::log_error("[CURRENT] {}", text);
+        report << text << "\n";
+    };
+    line(fmt::format("Map made no progress for {}s:", watchdog_timeout));
+    for (size_t k = 0; k < kernels.size(); k++) {
+        auto kernel = kernels[k];
+        auto incoming_connections = get_incoming_connections(kernel);
+        auto outgoing_connections = get_outgoing_connections(kernel);
+        for (uint32_t r = 0; r < kernel->num_replicas; r++) {
+            const auto& core = kernel->replica_cores[r];
+            auto records = read_watchdog_records(core);
+            const uint32_t *reader = records.data();
+            const uint32_t *compute = reader + WATCHDOG_RECORD_BYTES / sizeof(uint32_t);
+            const uint32_t *writer = compute + WATCHDOG_RECORD_BYTES / sizeof(uint32_t);
+            if (reader[0] == 2 && compute[0] == 2 && writer[0] == 2) {
+                continue;
+            }
+            auto expected = [&](const Connection& connection) {
+                return replica_n_tiles(get_n_tiles(connection), port_batch_tiles(connection_port(connection)), kernel->num_replicas, r);
+            };
+            auto cb_depth = [&](const Kernel::Port& port) {
+                return port.cb_n_tiles > 0 ? " of " + std::to_string(port.cb_n_tiles) : std::string();
+            };
+            auto describe = [&](const std::string& risc, const uint32_t *record, uint32_t wait_word, bool input_side) -> std::string {
+                if (record[0] == 0) {
+                    return risc + " never started";
+                }
+                if (record[0] == 2) {
+                    return risc + " done";
+                }
+                auto wait = (WatchdogWait)(record[wait_word] >> 16);
+                uint32_t i = record[wait_word] & 0xFFFF;
+                if (wait == WatchdogWait::Barrier) {
+                    return risc + " waiting on a NoC barrier";
+                }
+                if (wait == WatchdogWait::None || i >= (input_side ? incoming_connections.size() : outgoing_connections.size())) {
+                    return risc + " running";
+                }
+                if (input_side) {
+                    const auto& connection = incoming_connections[i];
+                    const auto& port = kernel->get_input_port(connection.dest.port);
+                    uint32_t filled = reader[WATCHDOG_INPUT_TILES + i];
+                    uint32_t drained = compute[WATCHDOG_INPUT_TILES + i];
+                    std::string tiles = fmt::format("{} tiles in the CB{}, {} of {} tiles read, {} consumed", filled - drained, cb_depth(port), filled, expected(connection), drained);
+                    switch (wait) {
+                        case WatchdogWait::CbFull: return fmt::format("{} blocked on input '{}', CB full ({})", risc, port.name, tiles);
+                        case WatchdogWait::CbEmpty: return fmt::format("{} starved on input '{}', CB empty ({})", risc, port.name, tiles);
+                        case WatchdogWait::Upstream: return fmt::format("{} waiting on kernel {} to deliver input '{}' ({})", risc, get_kernel_index(upstream_kernel(connection)), port.name, tiles);
+                        default: return fmt::format("{} waiting on a kernel sharing input '{}' to make room ({})", risc, port.name, tiles);
+                    }
+                }
+                const auto& connection = outgoing_connections[i];
+                const auto& port = kernel->get_output_port(connection.source.port);
+                uint32_t filled = compute[WATCHDOG_OUTPUT_TILES + i];
+                uint32_t drained = writer[WATCHDOG_OUTPUT_TILES + i];
+                std::string tiles = fmt::format("{} tiles in the CB{}, {} of {} tiles produced, {} written", filled - drained, cb_depth(port), filled, expected(connection), drained);
+                switch (wait) {
+                    case WatchdogWait::CbFull: return fmt::format("{} blocked on output '{}', CB full ({})", risc, port.name, tiles);
+                    case WatchdogWait::CbEmpty: return fmt::format("{} starved on output '{}', CB empty ({})", risc, port.name, tiles);
+                    default: return fmt::format("{} waiting on kernel {} to make room for output '{}' ({})", risc, connection.dest.index, port.name, tiles);
+                }
+            };
+            line(fmt::format("  Kernel {} replica {} on core ({}, {}):", k, r, core.x, core.y));
+            line("    " + describe("reader", reader, 1, true));
+            line("    " + describe("compute unpacker", compute, 1, true));
+            line("    " + describe("compute packer", compute, 2, false));
+            line("    " + describe("writer", writer, 1, false));
+        }
+    }
+    return report.str();
+}
+
+void Map::setup_stream_buffers(Session& session) {
+    auto setup = [&](Stream *stream, bool is_source) {
+        tt_metal::InterleavedBufferConfig config = {
+            .device = runtime.device,
+            .size = stream->n_tiles * stream->tile_size_bytes,
+            .page_size = stream->tile_size_bytes, // TODO: Not sure what is optimal for this.
+            .buffer_type = stream->memory == Stream::Memory::L1 ? tt_metal::BufferType::L1 : tt_metal::BufferType::DRAM
+        };
+        stream->device_buffer = tt_metal::CreateBuffer(config);
+        // Only sources need their data on the device. Skipping sinks also means we never read
+        // from a sink's host data while a previous execution might still be writing into it.
+        if (is_source) {
+            write_stream_buffer(session, stream);
+        }
+        stream->device_buffer_address = stream->device_buffer->address();
+        stream->device_buffer_noc_coordinates = stream->device_buffer->noc_coordinates();
+    };
+    for (size_t i = 0; i < streams.size(); i++) {
+        auto stream = streams[i];
+        if (stream->memory == Stream::Memory::Sharded || stream->is_view()) {
+            continue;
+        }
+        // Bases of views get read even if nothing else in the map reads them.
+        setup(stream, !is_sink_stream(i));
+    }
+    for (auto stream : backing_streams()) {
+        setup(stream, true);
+    }
+    // Views read straight out of their base's buffer.
+    for (auto stream : streams) {
+        if (stream->is_view()) {
+            stream->device_buffer = stream->view_base->device_buffer;
+            stream->device_buffer_address = stream->view_base->device_buffer_address;
+            stream->device_buffer_noc_coordinates = stream->view_base->device_buffer_noc_coordinates;
+        }
+    }
+}
+
+std::vector<Stream *> Map::backing_streams() const {
+    std::vector<Stream *> backing;
+    for (auto stream : streams) {
+        for (auto other : {stream->view_base, stream->view_indices}) {
+            if (other != nullptr && !graph.stream_index.contains(other) &&
+                std::find(backing.begin(), backing.end(), other) == backing.end()) {
+                backing.push_back(other);
+            }
+        }
+    }
+    return backing;
+}
+
+void Map::setup_sharded_stream_buffers(Session& session) {
+    for (size_t i = 0; i < streams.size(); i++) {
+        auto stream = streams[i];
+        if (stream->memory != Stream::Memory::Sharded) {
+            continue;
+        }
+        // One shard per replica of the reading kernel, holding the batches that replica owns back to back.
+        // Shards all have the size of the biggest one (replica 0's), the others get padded.
+        const auto& connection = sharded_stream_reader(i);
+        auto kernel = kernels[connection.dest.index];
+        uint32_t batch_tiles = port_batch_tiles(connection_port(connection));
+        uint32_t n_tiles = get_n_tiles(connection);
+        uint32_t shard_tiles = std::max<uint32_t>(1, replica_n_tiles(n_tiles, batch_tiles, kernel->num_replicas, 0));
+        auto cores = std::get<CoreRangeSet>(kernel->core_spec);
+        tt_metal::ShardedBufferConfig config = {
+            .device = runtime.device,
+            .size = kernel->num_replicas * shard_tiles * stream->tile_size_bytes,
+            .page_size = stream->tile_size_bytes,
+            .buffer_type = tt_metal::BufferType::L1,
+            .buffer_layout = TensorMemoryLayout::HEIGHT_SHARDED,
+            .shard_parameters = ShardSpecBuffer(cores, {shard_tiles * TILE_HEIGHT, TILE_WIDTH}, ShardOrientation::ROW_MAJOR, false,
+                                                {TILE_HEIGHT, TILE_WIDTH}, {kernel->num_replicas * shard_tiles, 1}),
+        };
+        stream->device_buffer = tt_metal::CreateBuffer(config);
+        stream->device_buffer_address = stream->device_buffer->address();
+        write_sharded_stream(session, i);
+    }
+}
+
+void Map::write_sharded_stream(Session& session, size_t stream_idx) {
+    auto stream = streams[stream_idx];
+    const auto& connection = sharded_stream_reader(stream_idx);
+    auto kernel = kernels[connection.dest.index];
+    uint32_t batch_tiles = port_batch_tiles(connection_port(connection));
+    uint32_t n_tiles = get_n_tiles(connection);
+    uint32_t shard_tiles = std::max<uint32_t>(1, replica_n_tiles(n_tiles, batch_tiles, kernel->num_replicas, 0));
+    auto cores = std::get<CoreRangeSet>(kernel->core_spec);
+    // Shards go to the cores in row major order, which isn't necessarily replica order.
+    auto shard_cores = corerange_to_cores(cores, std::nullopt, true);
+    size_t tile_words = stream->tile_size_bytes / sizeof(uint32_t);
+    std::vector<uint32_t> sharded(kernel->num_replicas * shard_tiles * tile_words, 0);
+    for (uint32_t shard = 0; shard < shard_cores.size(); shard++) {
+        auto replica = std::find(kernel->replica_cores.begin(), kernel->replica_cores.end(), shard_cores[shard]) - kernel->replica_cores.begin();
+        uint32_t replica_tiles = replica_n_tiles(n_tiles, batch_tiles, kernel->num_replicas, replica);
+        for (uint32_t t = 0; t < replica_tiles; t++) {
+            // Replica r owns batches r, r + num_replicas, ... (see set_runtime_args()).
+            uint32_t tile = (t / batch_tiles * kernel->num_replicas + replica) * batch_tiles + t % batch_tiles;
+            // The last tile can run past the end of the host data, the rest of it stays zero.
+            size_t offset = tile * tile_words;
+            std::copy_n(stream->host_data.begin() + offset, std::min(tile_words, stream->host_data.size() - offset),
+                        sharded.begin() + (shard * shard_tiles + t) * tile_words);
+        }
+    }
+    // Non-blocking, the host data is copied into the command queue when the write is enqueued.
+    tt_metal::EnqueueWriteBuffer(session.command_queue(), stream->device_buffer, sharded.data(), false);
+}
+
+void Map::write_source_streams(Session& session) {
+    for (size_t i = 0; i < streams.size(); i++) {
+        auto stream = streams[i];
+        if (is_sink_stream(i) || stream->is_view()) {
+            continue;
+        }
+        if (stream->memory == Stream::Memory::Sharded) {
+            write_sharded_stream(session, i);
+        } else {
+            write_stream_buffer(session, stream);
+        }
+    }
+    for (auto stream : backing_streams()) {
+        write_stream_buffer(session, stream);
+    }
+}
+
+void Map::write_stream_buffer(Session& session, Stream *stream) {
+    // Non-blocking, the host data is copied into the command queue when the write is enqueued.
+    if (stream->host_data.size() < stream->device_words()) {
+        std::vector<uint32_t> padded(stream->device_words(), 0);
+        std::copy(stream->host_data.begin(), stream->host_data.end(), padded.begin());
+        tt_metal::EnqueueWriteBuffer(session.command_queue(), stream->device_buffer, padded.data(), false);
+    } else {
+        tt_metal::EnqueueWriteBuffer(session.command_queue(), stream->device_buffer, stream->host_data.data(), false);
+    }
+}
+
+uint32_t Map::max_gather_ports() const {
+    uint32_t most = 0;
+    for (auto kernel : kernels) {
+        uint32_t n = 0;
+        for (const auto& connection : get_incoming_connections(kernel)) {
+            n += connection.source.is_stream() && streams[connection.source.index]->view_indices != nullptr;
+        }
+        most = std::max(most, n);
+    }
+    return most;
+}
+
+void Map::setup_gather_scratch() {
+    // Like the profile buffer, one page per L1 bank so every core gets its scratch at the same address.
+    uint32_t page_size = max_gather_ports() * tile_size_in_bytes(tt::DataFormat::UInt32);
+    tt_metal::InterleavedBufferConfig config = {
+        .device = runtime.device,
+        .size = page_size * runtime.device->num_banks(tt_metal::BufferType::L1),
+        .page_size = page_size,
+        .buffer_type = tt_metal::BufferType::L1
+    };
+    runtime.gather_scratch = tt_metal::CreateBuffer(config);
+}
 
-    // 1. Create device and program.
-    runtime.device = tt_metal::CreateDevice(0);
-    if (!runtime.device) {
-        std::cerr << "Failed to create device!\n";
-        exit(1);
+const Map::Connection& Map::sharded_stream_reader(size_t stream_idx) const {
+    for (size_t c : graph.readers[stream_idx]) {
+        if (upstream_kernel(connections[c]) == nullptr) {
+            return connections[c];
+        }
     }
-    runtime.program = tt_metal::CreateProgram();
-
-    // 2. Core grid setup.
-    // TODO: Have this configurable by user and dyanmic by runtime scheduling.
-    // Write now just set to # of kernels we have.
-    runtime.num_cores = kernels.size();
-    auto compute_with_storage_grid_size = runtime.device->compute_with_storage_grid_size();
-    runtime.num_cores_x = compute_with_storage_grid_size.x;
-    runtime.num_cores_y = compute_with_storage_grid_size.y;
-    runtime.core_set = num_cores_to_corerange_set({0, 0}, runtime.num_cores, {runtime.num_cores_x, runtime.num_cores_y});
-    tt::log_info("[CURRENT] num_cores_x: {}, num_cores_y: {}", runtime.num_cores_x, runtime.num_cores_y);
-    tt::log_info("[CURRENT] core_set: {}", runtime.core_set);
-    tt::log_info("[CURRENT] Total cores: {}", (*runtime.core_set.begin()).size());
+    assert(false && "Sharded stream has no reader!");
+    return connections[0];
+}
 
-    // 3. Input & Output DRAM buffer setup.
+uint32_t Map::l1_stream_bytes_per_core() const {
+    uint32_t bytes = max_gather_ports() * tile_size_in_bytes(tt::DataFormat::UInt32);
+    uint32_t banks = runtime.device->num_banks(tt_metal::BufferType::L1);
+    for (auto stream : backing_streams()) {
+        if (stream->memory == Stream::Memory::L1) {
+            bytes += (stream->n_tiles + banks - 1) / banks * stream->tile_size_bytes;
+        }
+    }
     for (size_t i = 0; i < streams.size(); i++) {
         auto stream = streams[i];
-        tt_metal::InterleavedBufferConfig config = {
-            .device = runtime.device,
-            .size = stream->n_elements * stream->element_size,
-            .page_size = stream->element_size * TILE_WIDTH * TILE_HEIGHT, // TODO: Not sure what is optimal for this.
-            .buffer_type = tt_metal::BufferType::DRAM
-        };
-        stream->device_buffer = tt_metal::CreateBuffer(config);
-        // TODO: Does this need to be blocking?
-        // TODO: What if there's a mismatch between the host data size and the device buffer size?
-        tt_metal::EnqueueWriteBuffer(runtime.device->command_queue(), stream->device_buffer, stream->host_data, true);
-        stream->device_buffer_address = stream->device_buffer->address();
-        stream->device_buffer_noc_coordinates = stream->device_buffer->noc_coordinates();
+        if (stream->is_view()) {
+            continue;
+        } else if (stream->memory == Stream::Memory::L1) {
+            bytes += (stream_n_tiles(stream) + banks - 1) / banks * stream->tile_size_bytes;
+        } else if (stream->memory == Stream::Memory::Sharded) {
+            // Only the reading kernel's cores hold a shard, but the CB budget is the same for every core.
+            const auto& connection = sharded_stream_reader(i);
+            auto kernel = kernels[connection.dest.index];
+            bytes += replica_n_tiles(get_n_tiles(connection), port_batch_tiles(connection_port(connection)), kernel->num_replicas, 0) * stream->tile_size_bytes;
+        }
     }
+    return bytes;
+}
 
-    // 4. Generate device kernels.
-    generate_device_kernels();
-
-    // Vector of cores we have availible to assign to kernels.
-    std::vector<CoreCoord> cores;
-    for (const CoreRange& range : runtime.core_set) {
-        for (const CoreCoord& core : range) {
-            cores.push_back(core);
+void Map::build_program() {
+    runtime.program = std::make_shared<tt_metal::Program>(tt_metal::CreateProgram());
+
+    // Kernel -> Kernel connections (and kernels sharing a stream) need a semaphore on each end for flow control.
+    // Cores have to be assigned beforehand since semaphores are allocated per core.
+    // Semaphores are created across all replicas so that every replica sees the same ID.
+    for (auto& connection : connections) {
+        if (connection.source.is_kernel() && connection.dest.is_kernel()) {
+            auto src_cores = std::get<CoreRangeSet>(kernels[connection.source.index]->core_spec);
+            auto dst_cores = std::get<CoreRangeSet>(kernels[connection.dest.index]->core_spec);
+            connection.sender_semaphore = tt_metal::CreateSemaphore(*runtime.program, src_cores, 0);
+            connection.receiver_semaphore = tt_metal::CreateSemaphore(*runtime.program, dst_cores, 0);
+            if (kernels[connection.dest.index]->num_replicas > kernels[connection.source.index]->num_replicas) {
+                connection.turn_semaphore = tt_metal::CreateSemaphore(*runtime.program, dst_cores, 0);
+            }
+        } else if (auto leader = shared_stream_leader(connection)) {
+            // Same handshake, with the leader's reader in place of the producer's writer.
+            auto src_cores = std::get<CoreRangeSet>(kernels[leader->dest.index]->core_spec);
+            auto dst_cores = std::get<CoreRangeSet>(kernels[connection.dest.index]->core_spec);
+            connection.sender_semaphore = tt_metal::CreateSemaphore(*runtime.program, src_cores, 0);
+            connection.receiver_semaphore = tt_metal::CreateSemaphore(*runtime.program, dst_cores, 0);
+            if (kernels[connection.dest.index]->num_replicas > kernels[leader->dest.index]->num_replicas) {
+                connection.turn_semaphore = tt_metal::CreateSemaphore(*runtime.program, dst_cores, 0);
+            }
         }
     }
 
     for (size_t i = 0; i < kernels.size(); i++) {
         auto kernel = kernels[i];
-        // Each kernel gets mapped to a single core. 
-        // We just assign to the next available core.
-        // TODO: Look into core placement strategies (RaftLib thesis)
-        // possibly doing automatic parallelization of kernels.
-        // NOTE: This also requires that we need as many cores as kernels.
-        kernel->core_spec = cores[i];
         auto incoming_connections = get_incoming_connections(kernel);
         auto outgoing_connections = get_outgoing_connections(kernel);
 
+        // Pick how deep each port's CB should be given how much L1 we have to work with.
+        auto cb_footprint = size_circular_buffers(kernel, incoming_connections, outgoing_connections, runtime.l1_budget);
+        tt::log_info("[CURRENT] Kernel {} CB footprint: {} / {} bytes of L1 per core", i, cb_footprint, runtime.l1_budget);
+
         // Create circular buffers for each incoming and outgoing connection.
         for (size_t i = 0; i < incoming_connections.size(); i++) {
             // Each port is typed with a specific data format. 
             auto cb_index = i + IN_CB_START;
-            auto port_index = incoming_connections[i].dest.index;
-            auto tile_size_bytes = TILE_WIDTH * TILE_HEIGHT * tt::datum_size(kernel->input_ports[port_index].data_format);
+            auto port_index = kernel->get_input_port_index(incoming_connections[i].dest.port);
+            auto tile_size_bytes = tile_size_in_bytes(kernel->input_ports[port_index].data_format);
             auto port = kernel->input_ports[port_index];
             tt_metal::CircularBufferConfig cb_config = CircularBufferConfig(
-                TILES_PER_CB * tile_size_bytes,
+                port.cb_n_tiles * tile_size_bytes,
                 {{cb_index, port.data_format}}
             ).set_page_size(cb_index, tile_size_bytes); // TODO: Not sure what to set this page size to.
-            kernel->input_ports[port_index].cb = tt_metal::CreateCircularBuffer(runtime.program, kernel->core_spec, cb_config);
+            kernel->input_ports[port_index].cb = tt_metal::CreateCircularBuffer(*runtime.program, kernel->core_spec, cb_config);
         }
 
         for (size_t i = 0; i < outgoing_connections.size(); i++) {
             auto cb_index = i + OUT_CB_START;
-            auto port_index = outgoing_connections[i].source.index;
+            auto port_index = kernel->get_output_port_index(outgoing_connections[i].source.port);
             auto port = kernel->output_ports[port_index];
-            auto tile_size_bytes = TILE_WIDTH * TILE_HEIGHT * tt::datum_size(port.data_format);
+            auto tile_size_bytes = tile_size_in_bytes(port.data_format);
             tt_metal::CircularBufferConfig cb_config = CircularBufferConfig(
-                TILES_PER_CB * tile_size_bytes,
+                port.cb_n_tiles * tile_size_bytes,
                 {{cb_index, port.data_format}}
             ).set_page_size(cb_index, tile_size_bytes); // TODO: Not sure what to set this page size to.
-            kernel->output_ports[port_index].cb = tt_metal::CreateCircularBuffer(runtime.program, kernel->core_spec, cb_config);
+            kernel->output_ports[port_index].cb = tt_metal::CreateCircularBuffer(*runtime.program, kernel->core_spec, cb_config);
         }
 
         // Create device kernels.
+        // Batch size and page sizes are compile-time args rather than literals in the source,
+        // so maps that only differ in those still share generated kernel files.
+        // Reader and compute loop over the input tiles, the writer over the output tiles.
+        auto input_defines = kernel_defines(kernel, incoming_connections);
+        auto output_defines = kernel_defines(kernel, outgoing_connections);
+        uint32_t input_batch_tiles = incoming_connections.empty() ? tiles_per_batch : port_batch_tiles(connection_port(incoming_connections[0]));
+        uint32_t output_batch_tiles = outgoing_connections.empty() ? tiles_per_batch : port_batch_tiles(connection_port(outgoing_connections[0]));
+        std::vector<uint32_t> reader_compile_args = {input_batch_tiles};
+        for (auto tile_bytes : port_tile_bytes(kernel, incoming_connections, true)) {
+            reader_compile_args.push_back(tile_bytes);
+        }
+        bool fp32_dest = uses_fp32_dest(kernel);
+        auto layout = dst_layout(kernel, incoming_connections, outgoing_connections);
+        std::vector<uint32_t> compute_compile_args = {input_batch_tiles, layout.tiles_per_acquire, layout.slots_per_tile, kernel->reduction_window};
+        std::vector<uint32_t> writer_compile_args = {output_batch_tiles};
+        for (auto tile_bytes : port_tile_bytes(kernel, outgoing_connections, false)) {
+            writer_compile_args.push_back(tile_bytes);
+        }
+
         auto reader = tt_metal::CreateKernel(
-            runtime.program,
+            *runtime.program,
             kernel->generated_reader_kernel_path,
             kernel->core_spec,
-            // TODO: Can also do compile-time args here? I think this might be useful.
             DataMovementConfig {
                 .processor = DataMovementProcessor::RISCV_0, 
                 .noc = NOC::RISCV_0_default,
-                .compile_args = {},
-                .defines = {}
+                .compile_args = reader_compile_args,
+                .defines = input_defines
             } // TODO: What to do for this?
         );
         kernel->reader_kernel = reader;
 
         auto compute = tt_metal::CreateKernel(
-            runtime.program,
+            *runtime.program,
             kernel->generated_compute_kernel_path,
             kernel->core_spec,
             ComputeConfig{
                 // TODO: Also need to figure out what the heck to do for this.
-                .dst_full_sync_en = true, // Don't know what this is lol
-                .math_approx_mode = false,
-                .compile_args = {},
-                .defines = {}
+                .fp32_dest_acc_en = fp32_dest,
+                .preserve_fp32_precision = fp32_dest,
+                .dst_full_sync_en = dst_sync == DstSync::Full,
+                .math_approx_mode = kernel->math_approx,
+                .compile_args = compute_compile_args,
+                .defines = input_defines
             }
         );
         kernel->compute_kernel = compute;
 
         auto writer = tt_metal::CreateKernel(
-            runtime.program,
+            *runtime.program,
             kernel->generated_writer_kernel_path,
             kernel->core_spec,
             DataMovementConfig {
                 .processor = DataMovementProcessor::RISCV_1,
                 .noc = NOC::RISCV_1_default,
-                .compile_args = {},
-                .defines = {}
+                .compile_args = writer_compile_args,
+                .defines = output_defines
             }
         );
         kernel->writer_kernel = writer;
+    }
+}
 
-        // Set runtime args.
-        std::vector<uint32_t> reader_args;
-        std::vector<uint32_t> compute_args;
-        for (const auto& connection : incoming_connections) {
-            if (connection.source.is_stream()) {
-                // For every incoming stream connection, we need to know how many tiles we expect to read and what the DRAM address is.
-                auto stream = streams[connection.source.index];
-                reader_args.push_back(stream->n_tiles);
-                reader_args.push_back(stream->device_buffer_address);
-                compute_args.push_back(stream->n_tiles); // Compute also needs to know how many tiles to read in.
-            } else {
-                // TODO: Handle incoming kernel connections.
-                tt::log_error("[CURRENT] Unsupported connection type!");
-                exit(1);
-            }
-        }
-        SetRuntimeArgs(runtime.program, kernel->reader_kernel, kernel->core_spec, reader_args);
-        SetRuntimeArgs(runtime.program, kernel->compute_kernel, kernel->core_spec, compute_args);
-
-        std::vector<uint32_t> writer_args;
-        for (const auto& connection : outgoing_connections) {
-            if (connection.dest.is_stream()) {
-                // TODO: Here we are explicitly setting the # of tiles we expect to write to be the same as the capacity of the stream.
-                // This can get a bit tricky if the compute does any sort of reduction and the user does not correctly set the capacity.
-                // I think if reduction kernels get implemented then we need a way of automatically determining the # of tiles to write at each stage of the program.
-                auto stream = streams[connection.dest.index];
-                writer_args.push_back(stream->n_tiles);
-                writer_args.push_back(stream->device_buffer_address);
-            } else {
-                // TODO: Handle outgoing kernel connections.
-                tt::log_error("[CURRENT] Unsupported connection type!");
-                exit(1);
+void Map::set_runtime_args() {
+    for (size_t i = 0; i < kernels.size(); i++) {
+        auto kernel = kernels[i];
+        auto incoming_connections = get_incoming_connections(kernel);
+        auto outgoing_connections = get_outgoing_connections(kernel);
+
+        // Set runtime args. Batches are dealt out round-robin, so replica r owns batches r, r + num_replicas, ...
+        for (uint32_t replica = 0; replica < kernel->num_replicas; replica++) {
+            auto core = kernel->replica_cores[replica];
+            std::vector<uint32_t> reader_args;
+            std::vector<uint32_t> compute_args;
+            uint32_t n_gathers = 0;
+            for (const auto& connection : incoming_connections) {
+                auto batch_tiles = port_batch_tiles(connection_port(connection));
+                auto n_tiles = replica_n_tiles(get_n_tiles(connection), batch_tiles, kernel->num_replicas, replica);
+                reader_args.push_back(n_tiles);
+                compute_args.push_back(n_tiles); // Compute also needs to know how many tiles to read in.
+                auto producer = upstream_kernel(connection);
+                if (producer == nullptr) {
+                    // For every incoming stream connection, we need to know which batches are ours and what the DRAM address is.
+                    // Sharded streams only hold our batches, back to back.
+                    auto stream = streams[connection.source.index];
+                    bool sharded = stream->memory == Stream::Memory::Sharded;
+                    reader_args.push_back(sharded ? 0 : replica * batch_tiles);
+                    reader_args.push_back(sharded ? batch_tiles : kernel->num_replicas * batch_tiles);
+                    reader_args.push_back(stream->device_buffer_address);
+                    if (stream->view_indices != nullptr) {
+                        // Every gather port of the kernel gets its own index tile of scratch.
+                        reader_args.push_back(stream->view_indices->device_buffer_address);
+                        reader_args.push_back(runtime.gather_scratch->address() + n_gathers * tile_size_in_bytes(tt::DataFormat::UInt32));
+                        n_gathers++;
+                    } else if (stream->is_view()) {
+                        reader_args.push_back(stream->view_offset);
+                        reader_args.push_back(stream->view_stride);
+                    }
+                    // Kernels sharing the stream with us get our batches forwarded, so we need to know where they live too.
+                    for (const auto& follower : shared_stream_followers(connection)) {
+                        auto consumer = kernels[follower.dest.index];
+                        reader_args.push_back(follower.sender_semaphore);
+                        reader_args.push_back(follower.receiver_semaphore);
+                        if (consumer->num_replicas > kernel->num_replicas) {
+                            reader_args.push_back(follower.turn_semaphore);
+                        }
+                        for (auto receiver : connected_replicas(kernel->num_replicas, consumer->num_replicas, replica)) {
+                            auto receiver_core = runtime.device->worker_core_from_logical_core(consumer->replica_cores[receiver]);
+                            reader_args.push_back(receiver_core.x);
+                            reader_args.push_back(receiver_core.y);
+                        }
+                    }
+                } else {
+                    // For every incoming kernel connection, we need to know where the producers live and which semaphores to signal.
+                    reader_args.push_back(connection.sender_semaphore);
+                    reader_args.push_back(connection.receiver_semaphore);
+                    if (kernel->num_replicas > producer->num_replicas) {
+                        reader_args.push_back(connection.turn_semaphore);
+                    }
+                    for (auto sender : connected_replicas(kernel->num_replicas, producer->num_replicas, replica)) {
+                        auto sender_core = runtime.device->worker_core_from_logical_core(producer->replica_cores[sender]);
+                        reader_args.push_back(sender_core.x);
+                        reader_args.push_back(sender_core.y);
+                    }
+                }
+            }
+            if (kernel->reduction == Kernel::Reduction::Mean) {
+                // Turns the sums into means. Whole stream reductions only ever have the one replica.
+                uint32_t window = kernel->reduction_window;
+                if (window == 0) {
+                    window = incoming_connections.empty() ? 1 : std::max<uint32_t>(compute_args[0], 1);
+                }
+                compute_args.push_back(std::bit_cast<uint32_t>(1.0f / window));
             }
+            for (const auto& parameter : kernel->parameters) {
+                compute_args.push_back(std::bit_cast<uint32_t>(parameter.value));
+            }
+            if (profiling) {
+                // Each RISC gets its own record in the core's profiling scratch.
+                reader_args.push_back(runtime.profile_buffer->address());
+                compute_args.push_back(runtime.profile_buffer->address() + PROFILE_RECORD_BYTES);
+            }
+            if (watchdog) {
+                reader_args.push_back(runtime.watchdog_buffer->address());
+                compute_args.push_back(runtime.watchdog_buffer->address() + WATCHDOG_RECORD_BYTES);
+            }
+            SetRuntimeArgs(*runtime.program, kernel->reader_kernel, core, reader_args);
+            SetRuntimeArgs(*runtime.program, kernel->compute_kernel, core, compute_args);
+
+            std::vector<uint32_t> writer_args;
+            for (const auto& connection : outgoing_connections) {
+                // The # of tiles we write follows from what the kernel reads and its port rates (see get_n_tiles()).
+                auto batch_tiles = port_batch_tiles(connection_port(connection));
+                auto n_tiles = replica_n_tiles(get_n_tiles(connection), batch_tiles, kernel->num_replicas, replica);
+                writer_args.push_back(n_tiles);
+                if (connection.dest.is_stream()) {
+                    auto stream = streams[connection.dest.index];
+                    writer_args.push_back(replica * batch_tiles);
+                    writer_args.push_back(kernel->num_replicas * batch_tiles);
+                    writer_args.push_back(stream->device_buffer_address);
+                } else {
+                    auto consumer = kernels[connection.dest.index];
+                    writer_args.push_back(connection.sender_semaphore);
+                    writer_args.push_back(connection.receiver_semaphore);
+                    if (consumer->num_replicas > kernel->num_replicas) {
+                        writer_args.push_back(connection.turn_semaphore);
+                    }
+                    for (auto receiver : connected_replicas(kernel->num_replicas, consumer->num_replicas, replica)) {
+                        auto receiver_core = runtime.device->worker_core_from_logical_core(consumer->replica_cores[receiver]);
+                        writer_args.push_back(receiver_core.x);
+                        writer_args.push_back(receiver_core.y);
+                    }
+                }
+            }
+            if (profiling) {
+                writer_args.push_back(runtime.profile_buffer->address() + 2 * PROFILE_RECORD_BYTES);
+            }
+            if (watchdog) {
+                writer_args.push_back(runtime.watchdog_buffer->address() + 2 * WATCHDOG_RECORD_BYTES);
+            }
+            SetRuntimeArgs(*runtime.program, kernel->writer_kernel, core, writer_args);
+        }
+    }
+}
+
+Session::CachedProgram Map::snapshot_program() const {
+    Session::CachedProgram entry;
+    entry.program = runtime.program;
+    for (const auto kernel : kernels) {
+        entry.kernel_handles.push_back({kernel->reader_kernel, kernel->compute_kernel, kernel->writer_kernel});
+        entry.replica_cores.push_back(kernel->replica_cores);
+        std::vector<uint32_t> depths;
+        for (const auto& port : kernel->input_ports) {
+            depths.push_back(port.cb_n_tiles);
+        }
+        for (const auto& port : kernel->output_ports) {
+            depths.push_back(port.cb_n_tiles);
         }
-        SetRuntimeArgs(runtime.program, kernel->writer_kernel, kernel->core_spec, writer_args);
+        entry.cb_n_tiles.push_back(depths);
     }
+    for (const auto& connection : connections) {
+        entry.semaphores.push_back({connection.sender_semaphore, connection.receiver_semaphore, connection.turn_semaphore});
+    }
+    return entry;
+}
 
-    tt_metal::EnqueueProgram(runtime.device->command_queue(), runtime.program, true);
-    tt_metal::Finish(runtime.device->command_queue());
-    tt::log_info("[CURRENT] Program execution completed!");
+void Map::restore_program(const Session::CachedProgram& cached) {
+    runtime.program = cached.program;
+    for (size_t i = 0; i < kernels.size(); i++) {
+        // The program's kernels and CBs live on the cores it was built for, whatever placement picked this time.
+        kernels[i]->replica_cores = cached.replica_cores[i];
+        kernels[i]->num_replicas = cached.replica_cores[i].size();
+        std::set<CoreRange> ranges;
+        for (const auto& core : kernels[i]->replica_cores) {
+            ranges.insert(CoreRange(core, core));
+        }
+        kernels[i]->core_spec = CoreRangeSet(ranges);
+        kernels[i]->reader_kernel = cached.kernel_handles[i][0];
+        kernels[i]->compute_kernel = cached.kernel_handles[i][1];
+        kernels[i]->writer_kernel = cached.kernel_handles[i][2];
+        // The CBs were sized when the program was built, not for whatever this map last built.
+        auto depth = cached.cb_n_tiles[i].begin();
+        for (auto& port : kernels[i]->input_ports) {
+            port.cb_n_tiles = *depth++;
+        }
+        for (auto& port : kernels[i]->output_ports) {
+            port.cb_n_tiles = *depth++;
+        }
+    }
+    for (size_t i = 0; i < connections.size(); i++) {
+        connections[i].sender_semaphore = cached.semaphores[i][0];
+        connections[i].receiver_semaphore = cached.semaphores[i][1];
+        connections[i].turn_semaphore = cached.semaphores[i][2];
+    }
+}
+
+void Map::capture_program(Session& session) {
+    Capture capture = {&session, std::nullopt};
+    if (session.supports_trace()) {
+        // The trace records the dispatch commands for the program, runtime args included, so replaying it skips all
+        // host side dispatch. The binaries are already on the device from the enqueue that came before.
+        auto cq_id = session.command_queue().id();
+        capture.trace_id = tt_metal::BeginTraceCapture(runtime.device, cq_id);
+        tt_metal::EnqueueProgram(session.command_queue(), *runtime.program, false);
+        tt_metal::EndTraceCapture(runtime.device, cq_id, *capture.trace_id);
+    }
+    captured = capture;
+    session.captured_maps.push_back(this);
+    tt::log_info("[CURRENT] Captured map, replaying {}", capture.trace_id ? "a trace" : "the program");
+}
 
-    // Read output from sink buffer.
-    // TODO: Right now we just hard-code this to the last stream, but need to figure out what streams we want to read from. 
-    // Could copy ALL streams's data back to their host buffer, then let the user decide which ones to read from via a Stream method.
-    std::vector<uint32_t> out;
-    tt_metal::EnqueueReadBuffer(runtime.device->command_queue(), streams[streams.size() - 1]->device_buffer, out, true);
+void Map::release_capture() {
+    if (!captured) {
+        return;
+    }
+    // The session always outlives the capture, it drops every capture taken on it when it goes away.
+    auto session = captured->session;
+    if (captured->trace_id) {
+        tt_metal::ReleaseTrace(session->get_device(), *captured->trace_id);
+    }
+    std::erase(session->captured_maps, this);
+    captured.reset();
+}
 
-    std::vector<bfloat16> output_data = unpack_uint32_vec_into_bfloat16_vec(out);
-    for (uint32_t i = 0; i < output_data.size(); i++) {
-        std::cout << i << ": " << output_data[i].to_float() << "\n";
+std::string Map::program_signature() const {
+    // Everything that ends up baked into the generated kernels, the CBs, or the core placement.
+    // Buffer addresses aren't part of it since those are only runtime args.
+    std::stringstream ss;
+    ss << "batch=" << tiles_per_batch << ";l1=" << cb_l1_budget << ";window=" << window_tiles.value_or(0) << ";placement=" << (int)placement << ";profiling=" << profiling << ";watchdog=" << watchdog << ";sharing=" << stream_sharing << ";dst_sync=" << (int)dst_sync << ";";
+    for (const auto kernel : kernels) {
+        ss << "kernel{replicas=" << kernel->num_replicas << ";";
+        for (const auto& port : kernel->input_ports) {
+            ss << "in:" << port.name << ":" << (int)port.data_format << ":" << port.rate << ";";
+        }
+        for (const auto& port : kernel->output_ports) {
+            ss << "out:" << port.name << ":" << (int)port.data_format << ":" << port.rate << ";";
+        }
+        ss << "reduction=" << (int)kernel->reduction << ":" << kernel->reduction_window << ";";
+        // Only the names, the values are runtime args.
+        for (const auto& parameter : kernel->parameters) {
+            ss << "param:" << parameter.name << ";";
+        }
+        ss << "approx=" << kernel->math_approx << ";";
+        ss << "sfpi=" << kernel->sfpi_kernel_string << "}";
+    }
+    for (const auto stream : streams) {
+        ss << "stream{" << stream->n_tiles << ":" << (int)stream->data_format << ":" << (int)stream->memory << ":"
+           << stream->is_view() << (stream->view_indices != nullptr) << "}";
     }
-    std::cout << std::endl;
+    for (const auto& connection : connections) {
+        ss << "conn{" << connection.source.is_kernel() << connection.source.index << ":" << connection.source.port
+           << "->" << connection.dest.is_kernel() << connection.dest.index << ":" << connection.dest.port << "}";
+    }
+    return ss.str();
+}
+
+bool Map::is_source_stream(size_t stream_idx) const {
+    return !graph.readers[stream_idx].empty();
+}
 
-    tt_metal::CloseDevice(runtime.device);
+bool Map::is_sink_stream(size_t stream_idx) const {
+    return !graph.writers[stream_idx].empty();
 }
 
 bool Map::has_incoming_connection(Kernel *kernel) {
-    // Get the index of our kernel in the kernels vector
-    size_t kernel_idx = get_kernel_index(kernel);
-    
-    // Check each connection
-    for (const Connection& connection : connections) {
-        // Is the destination endpoint a kernel?
-        if (connection.dest.is_kernel()) {
-            // Does its index match our target kernel?
-            if (connection.dest.index == kernel_idx) {
-                return true;  // Found an incoming connection!
+    return !graph.incoming[get_kernel_index(kernel)].empty();
+}
+
+std::vector<Map::Connection> Map::get_incoming_connections(Kernel *kernel) const {
+    std::vector<Connection> incoming_connections;
+    for (size_t c : graph.incoming[get_kernel_index(kernel)]) {
+        incoming_connections.push_back(connections[c]);
+    }
+    return incoming_connections;
+}
+
+std::vector<Map::Connection> Map::get_outgoing_connections(Kernel *kernel) const {
+    std::vector<Connection> outgoing_connections;
+    for (size_t c : graph.outgoing[get_kernel_index(kernel)]) {
+        outgoing_connections.push_back(connections[c]);
+    }
+    return outgoing_connections;
+}
+
+void Map::resolve_replicas(uint32_t total_cores) {
+    // Kernels with a fixed # of replicas get their cores first.
+    uint32_t fixed_cores = 0;
+    std::vector<size_t> auto_kernels;
+    for (size_t i = 0; i < kernels.size(); i++) {
+        auto kernel = kernels[i];
+        if (kernel->reduces_whole_stream()) {
+            // Every tile has to end up on the same core.
+            assert(kernel->requested_replicas <= 1 && "Kernels reducing a whole stream can't be replicated!");
+            kernel->num_replicas = 1;
+            fixed_cores += 1;
+        } else if (kernel->requested_replicas == Kernel::AUTO_REPLICAS) {
+            kernel->num_replicas = 1;
+            auto_kernels.push_back(i);
+        } else {
+            kernel->num_replicas = kernel->requested_replicas;
+            fixed_cores += kernel->num_replicas;
+        }
+    }
+    assert(fixed_cores + auto_kernels.size() <= total_cores && "Not enough cores for all kernel replicas!");
+
+    // No point in having more replicas than there are batches to process.
+    auto max_replicas = [&](Kernel *kernel) {
+        auto incoming_connections = get_incoming_connections(kernel);
+        auto outgoing_connections = get_outgoing_connections(kernel);
+        if (!incoming_connections.empty()) {
+            uint32_t batch_tiles = port_batch_tiles(connection_port(incoming_connections[0]));
+            return (get_n_tiles(incoming_connections[0]) + batch_tiles - 1) / batch_tiles;
+        } else if (!outgoing_connections.empty()) {
+            uint32_t batch_tiles = port_batch_tiles(connection_port(outgoing_connections[0]));
+            return (get_n_tiles(outgoing_connections[0]) + batch_tiles - 1) / batch_tiles;
+        }
+        return total_cores;
+    };
+
+    // Whatever is left goes to the auto-replicated kernels. A pipeline runs at the pace of its slowest stage,
+    // so keep handing cores to whichever kernel has the most work per replica.
+    // A kernel connected to other kernels only moves to the next count that still divides, or is a multiple of,
+    // the current count of every peer, and stops growing once no such count fits.
+    uint32_t free_cores = total_cores - fixed_cores - auto_kernels.size();
+    auto next_replicas = [&](size_t k) -> uint32_t {
+        auto kernel = kernels[k];
+        auto peers = connected_kernels(k);
+        uint32_t limit = std::min(kernel->num_replicas + free_cores, max_replicas(kernel));
+        for (uint32_t n = kernel->num_replicas + 1; n <= limit; n++) {
+            bool compatible = true;
+            for (size_t peer : peers) {
+                uint32_t peer_replicas = kernels[peer]->num_replicas;
+                if (std::max(n, peer_replicas) % std::min(n, peer_replicas) != 0) {
+                    compatible = false;
+                    break;
+                }
+            }
+            if (compatible) {
+                return n;
+            }
+        }
+        return 0;
+    };
+    while (true) {
+        Kernel *bottleneck = nullptr;
+        double bottleneck_load = 0;
+        uint32_t bottleneck_step = 0;
+        for (auto k : auto_kernels) {
+            auto kernel = kernels[k];
+            uint32_t n = next_replicas(k);
+            if (n == 0) {
+                continue;
+            }
+            uint32_t step = n - kernel->num_replicas;
+            double load = kernel->estimated_cost() / kernel->num_replicas;
+            if (bottleneck == nullptr || load > bottleneck_load) {
+                bottleneck = kernel;
+                bottleneck_load = load;
+                bottleneck_step = step;
             }
         }
+        if (bottleneck == nullptr) {
+            break;
+        }
+        bottleneck->num_replicas += bottleneck_step;
+        free_cores -= bottleneck_step;
+    }
+    for (auto k : auto_kernels) {
+        tt::log_info("[CURRENT] Kernel {} estimated cost: {}, replicas: {}", k, kernels[k]->estimated_cost(), kernels[k]->num_replicas);
+    }
+
+    // Producers fan out to consumers (and consumers fan in from producers) round-robin,
+    // which only lines up if one side's replica count is a multiple of the other's.
+    for (const auto& connection : connections) {
+        if (connection.source.is_kernel() && connection.dest.is_kernel()) {
+            uint32_t src_replicas = kernels[connection.source.index]->num_replicas;
+            uint32_t dst_replicas = kernels[connection.dest.index]->num_replicas;
+            assert(std::max(src_replicas, dst_replicas) % std::min(src_replicas, dst_replicas) == 0 &&
+                   "Connected kernels must have replica counts that are multiples of each other!");
+        }
+    }
+}
+
+uint32_t Map::replica_n_tiles(uint32_t n_tiles, uint32_t batch_size, uint32_t num_replicas, uint32_t replica) {
+    // Replica r gets every num_replicas'th batch starting at batch r. Only the very last batch can be partial.
+    uint32_t n_batches = (n_tiles + batch_size - 1) / batch_size;
+    uint32_t count = n_batches / num_replicas + (replica < n_batches % num_replicas ? 1 : 0);
+    if (count == 0) {
+        return 0;
     }
-    return false;
+    uint32_t tiles = count * batch_size;
+    if (n_tiles % batch_size != 0 && (n_batches - 1) % num_replicas == replica) {
+        tiles -= batch_size - n_tiles % batch_size;
+    }
+    return tiles;
 }
 
-std::vector<Map::Connection> Map::get_incoming_connections(Kernel *kernel) {
-    // Get the index of our kernel in the kernels vector
-    size_t kernel_idx = get_kernel_index(kernel);
+std::vector<uint32_t> Map::connected_replicas(uint32_t num_replicas, uint32_t num_peer_replicas, uint32_t replica) {
+    // Replicas of the side with fewer of them talk to several peers in turn, in the order batches reach them.
+    // Replicas of the side with more of them only ever talk to one peer.
+    std::vector<uint32_t> peers;
+    if (num_peer_replicas > num_replicas) {
+        for (uint32_t peer = replica; peer < num_peer_replicas; peer += num_replicas) {
+            peers.push_back(peer);
+        }
+    } else {
+        peers.push_back(replica % num_peer_replicas);
+    }
+    return peers;
+}
 
-    // Find all connections that have our kernel as the destination
-    std::vector<Connection> incoming_connections;
-    for (const Connection& connection : connections) {
-        if (connection.dest.index == kernel_idx) {
-            incoming_connections.push_back(connection);
+std::vector<size_t> Map::connected_kernels(size_t kernel_idx) const {
+    std::vector<size_t> peers;
+    auto add_peer = [&](size_t peer) {
+        if (peer != kernel_idx && std::find(peers.begin(), peers.end(), peer) == peers.end()) {
+            peers.push_back(peer);
+        }
+    };
+    for (size_t c : graph.outgoing[kernel_idx]) {
+        if (connections[c].dest.is_kernel()) {
+            add_peer(connections[c].dest.index);
         }
     }
-    return incoming_connections;
+    for (size_t c : graph.incoming[kernel_idx]) {
+        const auto& connection = connections[c];
+        if (connection.source.is_kernel()) {
+            add_peer(connection.source.index);
+        } else if (stream_sharing) {
+            // Kernels sharing a stream hand batches to each other just like connected kernels do.
+            for (size_t other : graph.readers[connection.source.index]) {
+                if (connections[other].dest.is_kernel()) {
+                    add_peer(connections[other].dest.index);
+                }
+            }
+        }
+    }
+    return peers;
 }
 
-std::vector<Map::Connection> Map::get_outgoing_connections(Kernel *kernel) {
-    // Get the index of our kernel in the kernels vector
-    size_t kernel_idx = get_kernel_index(kernel);
+const Map::Connection *Map::shared_stream_leader(const Connection& connection) const {
+    if (!stream_sharing || !connection.source.is_stream() || !connection.dest.is_kernel()) {
+        return nullptr;
+    }
+    order_graph();
+    const Connection *leader = nullptr;
+    for (size_t c : graph.readers[connection.source.index]) {
+        const auto& other = connections[c];
+        if (other.dest.is_kernel() && (leader == nullptr || graph.rank[other.dest.index] < graph.rank[leader->dest.index])) {
+            leader = &other;
+        }
+    }
+    // The leader reads from DRAM, and so does any other port of the leader reading the same stream.
+    if (leader->dest.index == connection.dest.index) {
+        return nullptr;
+    }
+    // Batches have to line up on both ends, and so do the replicas (see connected_replicas()).
+    if (port_batch_tiles(connection_port(*leader)) != port_batch_tiles(connection_port(connection))) {
+        return nullptr;
+    }
+    uint32_t leader_replicas = kernels[leader->dest.index]->num_replicas;
+    uint32_t replicas = kernels[connection.dest.index]->num_replicas;
+    uint32_t fewer = std::min(leader_replicas, replicas);
+    if (fewer == 0 || std::max(leader_replicas, replicas) % fewer != 0) {
+        return nullptr;
+    }
+    return leader;
+}
 
-    // Find all connections that have our kernel as the source
-    std::vector<Connection> outgoing_connections;
-    for (const Connection& connection : connections) {
-        if (connection.source.index == kernel_idx && connection.source.endpoint_type == Endpoint::EndpointType::Kernel) {
-            outgoing_connections.push_back(connection);
+std::vector<Map::Connection> Map::shared_stream_followers(const Connection& connection) const {
+    std::vector<Connection> followers;
+    if (!connection.source.is_stream()) {
+        return followers;
+    }
+    for (size_t c : graph.readers[connection.source.index]) {
+        const auto& other = connections[c];
+        auto leader = shared_stream_leader(other);
+        if (leader != nullptr && leader->dest.index == connection.dest.index && leader->dest.port == connection.dest.port) {
+            followers.push_back(other);
         }
     }
-    return outgoing_connections;
+    return followers;
+}
+
+Kernel *Map::upstream_kernel(const Connection& connection) const {
+    if (connection.source.is_kernel()) {
+        return kernels[connection.source.index];
+    }
+    auto leader = shared_stream_leader(connection);
+    return leader != nullptr ? kernels[leader->dest.index] : nullptr;
+}
+
+uint32_t Map::size_circular_buffers(
+    Kernel *kernel,
+    const std::vector<Connection>& incoming_connections,
+    const std::vector<Connection>& outgoing_connections,
+    uint32_t l1_budget
+) {
+    // Every CB gets its depth in whole batches so batched NoC transfers never wrap around the end of the CB.
+    struct PortCB {
+        Kernel::Port *port;
+        uint32_t tile_size_bytes;
+        uint32_t batch_tiles;
+        bool dram_facing; // Ports talking to DRAM have to hide much more latency than ports fed by another kernel.
+    };
+    std::vector<PortCB> cbs;
+    for (const auto& connection : incoming_connections) {
+        auto port = &kernel->input_ports[kernel->get_input_port_index(connection.dest.port)];
+        cbs.push_back({port, tile_size_in_bytes(port->data_format), port_batch_tiles(*port), upstream_kernel(connection) == nullptr});
+    }
+    for (const auto& connection : outgoing_connections) {
+        auto port = &kernel->output_ports[kernel->get_output_port_index(connection.source.port)];
+        cbs.push_back({port, tile_size_in_bytes(port->data_format), port_batch_tiles(*port), connection.dest.is_stream()});
+    }
+
+    auto footprint = [&]() {
+        uint32_t bytes = 0;
+        for (const auto& cb : cbs) {
+            bytes += cb.port->cb_n_tiles * cb.tile_size_bytes;
+        }
+        return bytes;
+    };
+
+    // Start with every port double buffered so the data movement kernels can fill one batch while compute drains the other.
+    for (auto& cb : cbs) {
+        cb.port->cb_n_tiles = MIN_BATCHES_PER_CB * cb.batch_tiles;
+    }
+    if (footprint() > l1_budget) {
+        // Single buffering still works, it just serializes data movement and compute.
+        tt::log_warning("[CURRENT] Not enough L1 to double buffer {} ports at batch size {}, falling back to single buffering", cbs.size(), tiles_per_batch);
+        for (auto& cb : cbs) {
+            cb.port->cb_n_tiles = cb.batch_tiles;
+        }
+        if (footprint() > l1_budget) {
+            tt::log_error("[CURRENT] CBs for {} ports at batch size {} need {} bytes, only {} bytes of L1 available!", cbs.size(), tiles_per_batch, footprint(), l1_budget);
+            exit(1);
+        }
+    }
+
+    // Hand out whatever L1 is left to the DRAM facing ports, one batch at a time, until they're MAX_BATCHES_PER_CB deep.
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (auto& cb : cbs) {
+            uint32_t batch_bytes = cb.batch_tiles * cb.tile_size_bytes;
+            if (cb.dram_facing && cb.port->cb_n_tiles < MAX_BATCHES_PER_CB * cb.batch_tiles && footprint() + batch_bytes <= l1_budget) {
+                cb.port->cb_n_tiles += cb.batch_tiles;
+                grew = true;
+            }
+        }
+    }
+
+    return footprint();
+}
+
+bool Map::is_fusable(const Connection& connection) {
+    if (!connection.source.is_kernel() || !connection.dest.is_kernel()) {
+        return false;
+    }
+    auto producer = kernels[connection.source.index];
+    auto consumer = kernels[connection.dest.index];
+    // Only linear chains: the producer feeds nothing but the consumer, and the consumer takes nothing but the producer.
+    // Both have to move one tile per tile, so a fused body still maps one input tile to one output tile.
+    for (auto kernel : {producer, consumer}) {
+        if (kernel->reduction != Kernel::Reduction::None) {
+            return false;
+        }
+        for (const auto& port : kernel->input_ports) {
+            if (port.rate != 1) {
+                return false;
+            }
+        }
+        for (const auto& port : kernel->output_ports) {
+            if (port.rate != 1) {
+                return false;
+            }
+        }
+    }
+    if (producer->num_output_ports() != 1 || get_outgoing_connections(producer).size() != 1 ||
+        consumer->num_input_ports() != 1 || get_incoming_connections(consumer).size() != 1) {
+        return false;
+    }
+    if (producer->requested_replicas != consumer->requested_replicas) {
+        return false;
+    }
+    // The fused kernel takes the producer's inputs and the consumer's outputs, so their names can't clash.
+    for (const auto& input : producer->input_ports) {
+        for (const auto& output : consumer->output_ports) {
+            if (input.name == output.name) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+size_t Map::fuse_kernels() {
+    size_t num_fused = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t c = 0; c < connections.size(); c++) {
+            if (!is_fusable(connections[c])) {
+                continue;
+            }
+            size_t producer_idx = connections[c].source.index;
+            size_t consumer_idx = connections[c].dest.index;
+            auto producer = kernels[producer_idx];
+            auto consumer = kernels[consumer_idx];
+
+            // The producer's output never leaves the SFPU registers, it's handed straight to the consumer's body.
+            // Each body gets its own scope so the consumer's in0 and the producer's out0 don't clash with the fused kernel's ports.
+            // An empty body just passes its input through.
+            std::string intermediate = "fused" + std::to_string(num_fused_kernels++);
+            std::string producer_body = producer->sfpi_kernel_string.empty() ? "        out0 = in0;\n" : producer->sfpi_kernel_string;
+            std::string consumer_body = consumer->sfpi_kernel_string.empty() ? "        out0 = in0;\n" : consumer->sfpi_kernel_string;
+            // The fused kernel has both kernels' parameters. Consumer parameters whose names are taken get renamed,
+            // and the consumer's scope shadows the new name with the old one.
+            std::vector<Kernel::Parameter> parameters = producer->parameters;
+            std::string consumer_parameters;
+            for (const auto& parameter : consumer->parameters) {
+                bool taken = std::any_of(parameters.begin(), parameters.end(), [&](const auto& p) { return p.name == parameter.name; });
+                if (taken) {
+                    std::string renamed = parameter.name + "_" + intermediate;
+                    parameters.push_back({renamed, parameter.value});
+                    consumer_parameters += "        vFloat " + parameter.name + " = " + renamed + ";\n";
+                } else {
+                    parameters.push_back(parameter);
+                }
+            }
+            std::string body;
+            body += "        vFloat " + intermediate + ";\n";
+            body += "        {\n";
+            body += "        vFloat out0;\n";
+            body += producer_body;
+            body += "        " + intermediate + " = out0;\n";
+            body += "        }\n";
+            body += "        {\n";
+            body += "        vFloat in0 = " + intermediate + ";\n";
+            body += consumer_parameters;
+            body += consumer_body;
+            body += "        }\n";
+
+            auto fused = std::make_unique<Kernel>();
+            fused->input_ports = producer->input_ports;
+            fused->output_ports = consumer->output_ports;
+            fused->input_port_indices = producer->input_port_indices;
+            fused->output_port_indices = consumer->output_port_indices;
+            fused->requested_replicas = producer->requested_replicas;
+            if (producer->cost > 0 && consumer->cost > 0) {
+                fused->cost = producer->cost + consumer->cost;
+            }
+            fused->set_compute_kernel(body);
+            fused->parameters = parameters;
+            // Approximations only where both sides were fine with them.
+            fused->math_approx = producer->math_approx && consumer->math_approx;
+
+            // The fused kernel takes the producer's slot, and the consumer's outgoing connections now come from it.
+            // Connection order is preserved so inN/outN keep referring to the same connections.
+            kernels[producer_idx] = fused.get();
+            kernels.erase(kernels.begin() + consumer_idx);
+            connections.erase(connections.begin() + c);
+            auto remap = [&](Endpoint& endpoint) {
+                if (!endpoint.is_kernel()) {
+                    return;
+                }
+                if (endpoint.index == consumer_idx) {
+                    endpoint.index = producer_idx;
+                }
+                if (endpoint.index > consumer_idx) {
+                    endpoint.index--;
+                }
+            };
+            for (auto& connection : connections) {
+                remap(connection.source);
+                remap(connection.dest);
+            }
+            owned_kernels.push_back(std::move(fused));
+            rebuild_graph();
+
+            tt::log_info("[CURRENT] Fused kernel {} into kernel {}", consumer_idx, producer_idx);
+            num_fused++;
+            changed = true;
+            break;
+        }
+    }
+    return num_fused;
+}
+
+uint32_t Map::get_n_tiles(const Connection& connection) const {
+    // Sources know their own size.
+    if (connection.source.is_stream()) {
+        return stream_n_tiles(streams[connection.source.index]);
+    }
+
+    // Whatever a kernel produces follows from how many steps its inputs last and the rate of the output port,
+    // so follow the producer's inputs upstream until we hit a stream.
+    auto producer = kernels[connection.source.index];
+    auto producer_incoming = get_incoming_connections(producer);
+    if (producer_incoming.empty()) {
+        // Without inputs, the kernel produces whatever its sink holds.
+        assert(connection.dest.is_stream() && "Can't determine # of tiles for a kernel with no inputs!");
+        return stream_n_tiles(streams[connection.dest.index]);
+    }
+    if (producer->reduces_whole_stream()) {
+        return 1;
+    }
+    auto input = producer->get_input_port(producer_incoming[0].dest.port);
+    auto output = producer->get_output_port(connection.source.port);
+    return get_n_tiles(producer_incoming[0]) / input.rate * output.rate;
+}
+
+Kernel::Port Map::connection_port(const Connection& connection) const {
+    if (connection.source.is_kernel()) {
+        return kernels[connection.source.index]->get_output_port(connection.source.port);
+    }
+    return kernels[connection.dest.index]->get_input_port(connection.dest.port);
+}
+
+bool Map::has_equal_port_lengths(const std::vector<Connection>& connections) const {
+    std::optional<uint32_t> n_tiles;
+    for (const auto& connection : connections) {
+        if (n_tiles && *n_tiles != get_n_tiles(connection)) {
+            return false;
+        }
+        n_tiles = get_n_tiles(connection);
+    }
+    return true;
+}
+
+std::map<std::string, std::string> Map::kernel_defines(Kernel *kernel, const std::vector<Connection>& connections) const {
+    // With equal length ports, a replica never sees a partial batch if the tiles split evenly into batches,
+    // and every replica moves the same # of tiles if the batches split evenly between replicas.
+    // Done separately for the input and the output side, which only differ in length if the kernel has port rates.
+    std::map<std::string, std::string> defines;
+    if (connections.empty() || !has_equal_port_lengths(connections)) {
+        return defines;
+    }
+    uint32_t n_tiles = get_n_tiles(connections[0]);
+    uint32_t batch_tiles = port_batch_tiles(connection_port(connections[0]));
+    if (n_tiles % batch_tiles == 0) {
+        defines["FULL_BATCHES"] = "1";
+    }
+    if (n_tiles % (batch_tiles * kernel->num_replicas) == 0) {
+        defines["N_TILES"] = std::to_string(n_tiles / kernel->num_replicas);
+    }
+    return defines;
+}
+
+bool Map::uses_fp32_dest(Kernel *kernel) const {
+    // Any 32 bit port keeps DST in 32 bit mode, so values don't get truncated on their way through the SFPU.
+    // Same for reductions, which accumulate in DST.
+    bool fp32_dest = kernel->reduction != Kernel::Reduction::None;
+    for (const auto& port : kernel->input_ports) {
+        fp32_dest |= is_32bit_data_format(port.data_format);
+    }
+    for (const auto& port : kernel->output_ports) {
+        fp32_dest |= is_32bit_data_format(port.data_format);
+    }
+    return fp32_dest;
+}
+
+uint32_t Map::dst_capacity(bool fp32_dest) const {
+    uint32_t tiles = fp32_dest ? DST_TILES / 2 : DST_TILES;
+    return dst_sync == DstSync::Half ? tiles / 2 : tiles;
+}
+
+Map::DstLayout Map::dst_layout(
+    Kernel *kernel,
+    const std::vector<Connection>& incoming_connections,
+    const std::vector<Connection>& outgoing_connections
+) const {
+    DstLayout layout;
+    uint32_t n_inputs = incoming_connections.size();
+    uint32_t n_outputs = outgoing_connections.size();
+    if (kernel->reduction != Kernel::Reduction::None) {
+        // Accumulators stay put for the whole window, inputs get copied in right behind them.
+        for (uint32_t i = 0; i < n_outputs; i++) {
+            layout.output_slots.push_back(i);
+        }
+        for (uint32_t i = 0; i < n_inputs; i++) {
+            layout.input_slots.push_back(n_outputs + i);
+        }
+        layout.slots_per_tile = n_outputs + n_inputs;
+    } else if (fpu_eltwise(kernel, incoming_connections, outgoing_connections)) {
+        // The FPU reads its operands straight from the CBs, only the result lands in DST.
+        layout.output_slots.push_back(0);
+        layout.slots_per_tile = 1;
+    } else {
+        // The SFPI body reads a row of every input before it writes that row of any output,
+        // so output i can take over input i's slot.
+        for (uint32_t i = 0; i < n_inputs; i++) {
+            layout.input_slots.push_back(i);
+        }
+        for (uint32_t i = 0; i < n_outputs; i++) {
+            layout.output_slots.push_back(i);
+        }
+        layout.slots_per_tile = std::max<uint32_t>({n_inputs, n_outputs, 1});
+    }
+    // As many tiles as fit in DST go through per acquire. Windowed reductions do one output tile per acquire.
+    uint32_t capacity = dst_capacity(uses_fp32_dest(kernel));
+    layout.tiles_per_acquire = kernel->reduction != Kernel::Reduction::None
+        ? 1
+        : std::max<uint32_t>(1, std::min(tiles_per_batch, capacity / layout.slots_per_tile));
+    return layout;
+}
+
+std::vector<uint32_t> Map::port_tile_bytes(Kernel *kernel, const std::vector<Connection>& connections, bool incoming) const {
+    // Stream ports use the stream's page size, kernel ports the size of a tile in the port's format.
+    std::vector<uint32_t> tile_bytes;
+    for (const auto& connection : connections) {
+        const auto& endpoint = incoming ? connection.source : connection.dest;
+        if (endpoint.is_stream()) {
+            tile_bytes.push_back(streams[endpoint.index]->tile_size_bytes);
+        } else {
+            auto port = incoming ? kernel->get_input_port(connection.dest.port) : kernel->get_output_port(connection.source.port);
+            tile_bytes.push_back(tile_size_in_bytes(port.data_format));
+        }
+    }
+    return tile_bytes;
+}
+
+uint64_t fnv1a_hash(const std::string& s) {
+    // Unlike std::hash, stable across builds and platforms, so generated file names are too.
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : s) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::optional<Kernel::Eltwise> Map::fpu_eltwise(
+    Kernel *kernel,
+    const std::vector<Connection>& incoming_connections,
+    const std::vector<Connection>& outgoing_connections
+) const {
+    auto eltwise = kernel->eltwise_op();
+    if (!eltwise || kernel->reduction != Kernel::Reduction::None || outgoing_connections.size() != 1 ||
+        eltwise->lhs >= incoming_connections.size() || eltwise->rhs >= incoming_connections.size()) {
+        return std::nullopt;
+    }
+    // The FPU's source registers hold 19 bit floats, so it only gets bfloat16 (and Bfp8_b) inputs exactly right.
+    // Integer ports are SFPU only, on both ends.
+    for (auto index : {eltwise->lhs, eltwise->rhs}) {
+        auto format = kernel->get_input_port(incoming_connections[index].dest.port).data_format;
+        if (format != tt::DataFormat::Float16_b && format != tt::DataFormat::Bfp8_b) {
+            return std::nullopt;
+        }
+    }
+    auto output_format = kernel->get_output_port(outgoing_connections[0].source.port).data_format;
+    if (output_format == tt::DataFormat::Int32 || output_format == tt::DataFormat::UInt32) {
+        return std::nullopt;
+    }
+    return eltwise;
 }
 
 std::string data_format_to_string(tt::DataFormat data_format) {
     // std::cout << "Data format: " << data_format << "\n";
     switch (data_format) {
+        case tt::DataFormat::Bfp8_b: return "DataFormat::Bfp8_b";
         case tt::DataFormat::Float16_b: return "DataFormat::Float16_b";
+        case tt::DataFormat::Float32: return "DataFormat::Float32";
+        case tt::DataFormat::Int32: return "DataFormat::Int32";
+        case tt::DataFormat::UInt32: return "DataFormat::UInt32";
         default:
             std::cerr << "Unsupported data format!\n";
             exit(1);
     }
 }
 
-void Map::generate_reader_device_kernel(
+std::string Map::generate_reader_device_kernel(
     Kernel *kernel,
     std::vector<Connection> incoming_connections
-) {
+) const {
     // Generate reader kernel.
     std::stringstream rs;
     rs << "#include <cstdint>\n";
     rs << "#include \"dataflow_api.h\"\n";
     rs << "#include \"debug/dprint.h\"\n";
+    if (profiling) {
+        rs << "inline uint64_t prof_cycles() { uint32_t lo = reg_read(RISCV_DEBUG_REG_WALL_CLOCK_L); return ((uint64_t)reg_read(RISCV_DEBUG_REG_WALL_CLOCK_H) << 32) | lo; }\n";
+    }
     rs << "void kernel_main() {\n";
+    if (profiling) {
+        rs << "    uint64_t prof_start = prof_cycles();\n";
+        rs << "    uint64_t prof_t;\n";
+        rs << "    uint64_t prof_counters[" << PROFILE_COUNTERS << "] = {0};\n";
+    }
 
     // Reader params from kernel args
     uint32_t total_args = 0;
+    // Who fills each port's CB over the NoC (nullptr if we read it from DRAM), and who we forward our DRAM reads to.
+    std::vector<Kernel *> upstream;
+    std::vector<std::vector<Connection>> followers;
+    bool forwards = false;
+    for (const auto& connection : incoming_connections) {
+        upstream.push_back(upstream_kernel(connection));
+        followers.push_back(upstream.back() == nullptr ? shared_stream_followers(connection) : std::vector<Connection>{});
+        forwards |= !followers.back().empty();
+    }
 
     for (size_t i = 0; i < incoming_connections.size(); i++) {
         auto connection = incoming_connections[i];
-        if (connection.source.is_stream()) {
+        // Total # of tiles this kernel will read from this port.
+        auto port = kernel->get_input_port(connection.dest.port);
+        rs << "#ifdef N_TILES\n";
+        rs << "    constexpr uint32_t " << port.name << "_ntiles = N_TILES;\n";
+        rs << "#else\n";
+        rs << "    uint32_t " << port.name << "_ntiles = get_arg_val<uint32_t>(" << total_args << ");\n";
+        rs << "#endif\n";
+        total_args++;
+        rs << "    constexpr uint32_t " << port.name << "_tile_bytes = get_compile_time_arg_val(" << 1 + i << ");\n";
+        if (upstream[i] == nullptr) {
             auto stream = streams[connection.source.index];
-            // Total # of tiles this kernel will read from this stream.
-            // Stream -> Kernel, get the input port index.
-            auto port = kernel->get_input_port(connection.dest.port);
-            rs << "    uint32_t " << port.name << "_ntiles = get_arg_val<uint32_t>(" << total_args << ");\n";
+            // Index of the first tile of the slice this replica is responsible for.
+            rs << "    uint32_t " << port.name << "_tile_offset = get_arg_val<uint32_t>(" << total_args << ");\n";
+            total_args++;
+            // Tiles between the starts of two consecutive batches of this replica.
+            rs << "    uint32_t " << port.name << "_tile_stride = get_arg_val<uint32_t>(" << total_args << ");\n";
             total_args++;
             // For every incoming stream connection, we need to get it's address and create an address generator.
             rs << "    uint32_t " << port.name << "_addr = get_arg_val<uint32_t>(" << total_args << ");\n";
             total_args++;
-            // Address generator.
-            // TODO: Do we need this? How does this even work?
-            rs << "    const InterleavedAddrGenFast<true> " << port.name << "_addr_gen = {\n";
-            rs << "        .bank_base_address = " << port.name << "_addr, \n";
-            rs << "        .page_size = " << TILE_WIDTH * TILE_HEIGHT * stream->element_size << ", \n";
-            rs << "        .data_format = " << data_format_to_string(stream->data_format) << ", \n";
-            rs << "    };\n\n";
+            if (stream->memory == Stream::Memory::Sharded) {
+                // Our shard sits at the same address in our own L1, no address generator needed.
+                rs << "\n";
+            } else {
+                // Address generator.
+                // TODO: Do we need this? How does this even work?
+                rs << "    const InterleavedAddrGenFast<" << (stream->memory == Stream::Memory::Dram ? "true" : "false") << "> " << port.name << "_addr_gen = {\n";
+                rs << "        .bank_base_address = " << port.name << "_addr, \n";
+                rs << "        .page_size = " << port.name << "_tile_bytes, \n";
+                rs << "        .data_format = " << data_format_to_string(stream->data_format) << ", \n";
+                rs << "    };\n\n";
+            }
+            if (stream->view_indices != nullptr) {
+                // Gather: the k-th tile we read is tile indices[k] of the base. Indices get pulled in a tile at a time into L1 scratch.
+                rs << "    uint32_t " << port.name << "_idx_addr = get_arg_val<uint32_t>(" << total_args << ");\n";
+                total_args++;
+                rs << "    volatile tt_l1_ptr uint32_t* " << port.name << "_idx = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_arg_val<uint32_t>(" << total_args << "));\n";
+                total_args++;
+                rs << "    const InterleavedAddrGenFast<" << (stream->view_indices->memory == Stream::Memory::Dram ? "true" : "false") << "> " << port.name << "_idx_addr_gen = {\n";
+                rs << "        .bank_base_address = " << port.name << "_idx_addr, \n";
+                rs << "        .page_size = " << tile_size_in_bytes(tt::DataFormat::UInt32) << ", \n";
+                rs << "        .data_format = DataFormat::UInt32, \n";
+                rs << "    };\n";
+                rs << "    uint32_t " << port.name << "_idx_tile = 0xFFFFFFFF; // Index tile currently in scratch.\n\n";
+            } else if (stream->is_view()) {
+                // The k-th tile we read is tile view_offset + k * view_stride of the base.
+                rs << "    uint32_t " << port.name << "_view_offset = get_arg_val<uint32_t>(" << total_args << ");\n";
+                total_args++;
+                rs << "    uint32_t " << port.name << "_view_stride = get_arg_val<uint32_t>(" << total_args << ");\n\n";
+                total_args++;
+            }
+            // Kernels sharing this stream get every batch forwarded straight from our CB, with the same handshake
+            // a producer's writer does (see generate_writer_device_kernel()).
+            for (size_t f = 0; f < followers[i].size(); f++) {
+                auto consumer = kernels[followers[i][f].dest.index];
+                auto n_receivers = connected_replicas(kernel->num_replicas, consumer->num_replicas, 0).size();
+                auto name = port.name + "_fwd" + std::to_string(f);
+                rs << "    volatile tt_l1_ptr uint32_t* " << name << "_sender_sem = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_semaphore(get_arg_val<uint32_t>(" << total_args << ")));\n";
+                total_args++;
+                rs << "    uint32_t " << name << "_receiver_sem_addr = get_semaphore(get_arg_val<uint32_t>(" << total_args << "));\n";
+                total_args++;
+                if (consumer->num_replicas > kernel->num_replicas) {
+                    rs << "    uint32_t " << name << "_turn_sem_addr = get_semaphore(get_arg_val<uint32_t>(" << total_args << "));\n";
+                    total_args++;
+                }
+                rs << "    constexpr uint32_t " << name << "_n_receivers = " << n_receivers << ";\n";
+                rs << "    uint32_t " << name << "_receiver_noc_x[" << name << "_n_receivers];\n";
+                rs << "    uint32_t " << name << "_receiver_noc_y[" << name << "_n_receivers];\n";
+                for (size_t r = 0; r < n_receivers; r++) {
+                    rs << "    " << name << "_receiver_noc_x[" << r << "] = get_arg_val<uint32_t>(" << total_args << ");\n";
+                    rs << "    " << name << "_receiver_noc_y[" << r << "] = get_arg_val<uint32_t>(" << total_args + 1 << ");\n";
+                    total_args += 2;
+                }
+                if (consumer->num_replicas > kernel->num_replicas) {
+                    rs << "    if (" << port.name << "_ntiles > 0) {\n";
+                    rs << "        noc_semaphore_inc(get_noc_addr(" << name << "_receiver_noc_x[0], " << name << "_receiver_noc_y[0], " << name << "_turn_sem_addr), 1);\n";
+                    rs << "    }\n";
+                }
+                rs << "\n";
+            }
         } else {
-            // TODO: Handle incoming kernel connections.
-            std::cerr << "Unsupported connection type!\n";
-            exit(1);
+            // Kernel -> Kernel. The producer's writer pushes tiles straight into our CB over the NoC.
+            // Handshake per batch:
+            //   1. If the producer feeds several of us, we wait for our turn.
+            //   2. We reserve slots and write their L1 address into the producer's sender semaphore.
+            //   3. The producer writes the batch into those slots and increments our receiver semaphore.
+            // If there's more producer replicas than consumer replicas, we take batches from each producer in turn.
+            // A kernel sharing a stream with us plays the producer for that stream.
+            auto producer = upstream[i];
+            auto n_senders = connected_replicas(kernel->num_replicas, producer->num_replicas, 0).size();
+            rs << "    uint32_t " << port.name << "_sender_sem_addr = get_semaphore(get_arg_val<uint32_t>(" << total_args << "));\n";
+            total_args++;
+            rs << "    volatile tt_l1_ptr uint32_t* " << port.name << "_receiver_sem = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_semaphore(get_arg_val<uint32_t>(" << total_args << ")));\n";
+            total_args++;
+            if (kernel->num_replicas > producer->num_replicas) {
+                rs << "    volatile tt_l1_ptr uint32_t* " << port.name << "_turn_sem = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_semaphore(get_arg_val<uint32_t>(" << total_args << ")));\n";
+                total_args++;
+            }
+            rs << "    constexpr uint32_t " << port.name << "_n_senders = " << n_senders << ";\n";
+            rs << "    uint64_t " << port.name << "_sender_sem_noc_addr[" << port.name << "_n_senders];\n";
+            for (size_t s = 0; s < n_senders; s++) {
+                rs << "    " << port.name << "_sender_sem_noc_addr[" << s << "] = get_noc_addr(get_arg_val<uint32_t>(" << total_args << "), get_arg_val<uint32_t>(" << total_args + 1 << "), " << port.name << "_sender_sem_addr);\n";
+                total_args += 2;
+            }
+            rs << "\n";
         }
     }
 
+    if (profiling) {
+        rs << "    volatile tt_l1_ptr uint32_t* prof = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_arg_val<uint32_t>(" << total_args << "));\n\n";
+        total_args++;
+    }
+    if (watchdog) {
+        rs << "    volatile tt_l1_ptr uint32_t* wd = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_arg_val<uint32_t>(" << total_args << "));\n";
+        rs << "    wd[0] = 1;\n\n";
+        total_args++;
+    }
+
     // Circular buffers.
     uint32_t num_input_cbs = 0;
     for (size_t i = 0; i < incoming_connections.size(); i++) {
@@ -383,8 +2863,141 @@ void Map::generate_reader_device_kernel(
         num_input_cbs++;
     }
     rs << "\n";
+    rs << "    constexpr uint32_t BATCH_SIZE = get_compile_time_arg_val(0);\n";
+    rs << "\n";
+
+    // Per batch, for every port: reserve CB space, issue the reads (or hand the slots to the upstream kernel),
+    // wait for all of them at once, then push. `guard` wraps a port's statements in its bounds check, if it needs one.
+    auto emit_batch = [&](const std::string& indent, auto count, auto batch, auto guard) {
+        // Wait for space in CBs
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            rs << guard(port.name, instrument_wait(indent, "cb_reserve_back(" + port.name + ", " + batch(port.name) + ");", 2 + 2 * i, WatchdogWait::CbFull, i));
+        }
+        // Where this batch starts in the CBs we forward from. Reserving doesn't move the write pointer.
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            if (!followers[i].empty()) {
+                auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+                rs << indent << "uint32_t " << port.name << "_fwd_ptr = get_write_ptr(" << port.name << ");\n";
+            }
+        }
+        // Read tiles into CB from DRAM, or hand the reserved slots to the upstream kernel.
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            std::stringstream body;
+            body << indent << "uint32_t " << port.name << "_write_ptr = get_write_ptr(" << port.name << ");\n";
+            if (upstream[i] == nullptr && streams[incoming_connections[i].source.index]->memory == Stream::Memory::Sharded) {
+                // The batch is contiguous in our shard, so it comes over as a single local read.
+                body << indent << "noc_async_read(get_noc_addr(" << port.name << "_addr + (" << port.name << "_tile_offset + (" << count(port.name) << " / BATCH_SIZE) * " << port.name << "_tile_stride) * " << port.name << "_tile_bytes), " << port.name << "_write_ptr, " << batch(port.name) << " * " << port.name << "_tile_bytes);\n";
+            } else if (upstream[i] == nullptr) {
+                auto stream = streams[incoming_connections[i].source.index];
+                // Position of the tile in the stream, which for views maps onto a tile of the base.
+                std::string pos = port.name + "_tile_offset + (" + count(port.name) + " / BATCH_SIZE) * " + port.name + "_tile_stride + j";
+                std::string tile = pos;
+                body << "#pragma GCC unroll 16\n";
+                body << indent << "for (uint32_t j = 0; j < " << batch(port.name) << "; j++) {\n";
+                if (stream->view_indices != nullptr) {
+                    body << indent << "    uint32_t " << port.name << "_pos = " << pos << ";\n";
+                    body << indent << "    if (" << port.name << "_pos / " << TILE_SIZE << " != " << port.name << "_idx_tile) {\n";
+                    body << indent << "        " << port.name << "_idx_tile = " << port.name << "_pos / " << TILE_SIZE << ";\n";
+                    body << indent << "        noc_async_read_tile(" << port.name << "_idx_tile, " << port.name << "_idx_addr_gen, (uint32_t)" << port.name << "_idx);\n";
+                    body << indent << "        noc_async_read_barrier();\n";
+                    body << indent << "    }\n";
+                    tile = port.name + "_idx[" + port.name + "_pos % " + std::to_string(TILE_SIZE) + "]";
+                } else if (stream->is_view()) {
+                    tile = port.name + "_view_offset + (" + pos + ") * " + port.name + "_view_stride";
+                }
+                body << indent << "    noc_async_read_tile(" << tile << ", " <<  port.name << "_addr_gen, " << port.name << "_write_ptr);\n";
+                body << indent << "    " << port.name << "_write_ptr += " << port.name << "_tile_bytes;\n";
+                body << indent << "}\n";
+            } else {
+                if (kernel->num_replicas > upstream[i]->num_replicas) {
+                    body << instrument_wait(indent, "noc_semaphore_wait(" + port.name + "_turn_sem, 1);", 3 + 2 * i, WatchdogWait::Upstream, i);
+                    body << indent << "noc_semaphore_set(" << port.name << "_turn_sem, 0);\n";
+                }
+                body << indent << "noc_semaphore_set(" << port.name << "_receiver_sem, 0);\n";
+                body << indent << "noc_inline_dw_write(" << port.name << "_sender_sem_noc_addr[(" << count(port.name) << " / BATCH_SIZE) % " << port.name << "_n_senders], " << port.name << "_write_ptr);\n";
+            }
+            rs << guard(port.name, body.str());
+        }
+        // Wait until tile reads are done.
+        rs << "\n";
+        rs << instrument_wait(indent, "noc_async_read_barrier();", 1, WatchdogWait::Barrier, 0);
+        // Wait until upstream kernels have written their tiles into our CBs.
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            if (upstream[i] != nullptr) {
+                auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+                rs << guard(port.name, instrument_wait(indent, "noc_semaphore_wait(" + port.name + "_receiver_sem, 1);", 3 + 2 * i, WatchdogWait::Upstream, i));
+            }
+        }
+        rs << "\n";
+        // Push tiles into CBs.
+        // Signals to compute engine that a batch of tiles is ready to be processed.
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            rs << guard(port.name, indent + "cb_push_back(" + port.name + ", " + batch(port.name) + ");\n" +
+                                   watchdog_tiles(indent, WATCHDOG_INPUT_TILES + i, batch(port.name)));
+        }
+        // Forward the batches we read to the kernels sharing the stream. Our compute can already start on them,
+        // the slots only get reused once we reserve them again, after the writes below have completed.
+        if (!forwards) {
+            return;
+        }
+        rs << "\n";
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            std::stringstream body;
+            for (size_t f = 0; f < followers[i].size(); f++) {
+                auto name = port.name + "_fwd" + std::to_string(f);
+                rs << indent << "uint32_t " << name << "_dst = (" << count(port.name) << " / BATCH_SIZE) % " << name << "_n_receivers;\n";
+                body << instrument_wait(indent, "while (*" + name + "_sender_sem == 0);", 2 + 2 * i, WatchdogWait::Downstream, i);
+                body << indent << "uint32_t " << name << "_dst_addr = *" << name << "_sender_sem;\n";
+                body << indent << "noc_semaphore_set(" << name << "_sender_sem, 0);\n";
+                if (kernels[followers[i][f].dest.index]->num_replicas > kernel->num_replicas) {
+                    body << indent << "if (" << count(port.name) << " + BATCH_SIZE < " << port.name << "_ntiles) {\n";
+                    body << indent << "    uint32_t " << name << "_next = (" << name << "_dst + 1) % " << name << "_n_receivers;\n";
+                    body << indent << "    noc_semaphore_inc(get_noc_addr(" << name << "_receiver_noc_x[" << name << "_next], " << name << "_receiver_noc_y[" << name << "_next], " << name << "_turn_sem_addr), 1);\n";
+                    body << indent << "}\n";
+                }
+                body << indent << "noc_async_write(" << port.name << "_fwd_ptr, get_noc_addr(" << name << "_receiver_noc_x[" << name << "_dst], " << name << "_receiver_noc_y[" << name << "_dst], " << name << "_dst_addr), " << batch(port.name) << " * " << port.name << "_tile_bytes);\n";
+            }
+            if (!followers[i].empty()) {
+                rs << guard(port.name, body.str());
+            }
+        }
+        rs << instrument_wait(indent, "noc_async_write_barrier();", 1, WatchdogWait::Barrier, 0);
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            std::stringstream body;
+            for (size_t f = 0; f < followers[i].size(); f++) {
+                auto name = port.name + "_fwd" + std::to_string(f);
+                body << indent << "noc_semaphore_inc(get_noc_addr(" << name << "_receiver_noc_x[" << name << "_dst], " << name << "_receiver_noc_y[" << name << "_dst], " << name << "_receiver_sem_addr), 1);\n";
+            }
+            if (!followers[i].empty()) {
+                rs << guard(port.name, body.str());
+            }
+        }
+    };
 
-    if (incoming_connections.size() > 0) {
+    if (incoming_connections.size() > 0 && has_equal_port_lengths(incoming_connections)) {
+        // Input tile stream loop.
+        // Every port moves the same # of tiles, so one counter drives all of them and nothing needs a bounds check.
+        auto first = kernel->get_input_port(incoming_connections[0].dest.port);
+        rs << "    for (uint32_t count = 0; count < " << first.name << "_ntiles; count += BATCH_SIZE) {\n";
+        rs << "#ifdef FULL_BATCHES\n";
+        rs << "        constexpr uint32_t batch = BATCH_SIZE;\n";
+        rs << "#else\n";
+        rs << "        uint32_t batch = " << first.name << "_ntiles - count;\n";
+        rs << "        if (batch > BATCH_SIZE) batch = BATCH_SIZE;\n";
+        rs << "#endif\n";
+        rs << "\n";
+        emit_batch("        ",
+                   [](const std::string&) { return std::string("count"); },
+                   [](const std::string&) { return std::string("batch"); },
+                   [](const std::string&, const std::string& code) { return code; });
+        rs << "    }\n";
+        // End tile stream loop.
+    } else if (incoming_connections.size() > 0) {
         // Input tile stream loop.
         for (size_t i = 0; i < incoming_connections.size(); i++) {
             // Generate a counter variable for every incoming connection. 
@@ -408,96 +3021,123 @@ void Map::generate_reader_device_kernel(
             }
         }
 
-        // rs << "    for(uint32_t i = 0; i < source0_n_tiles; i++) {\n";
         rs << "    while(" << break_condition << ") {\n";
 
-        // Wait for space in CBs
-        for (size_t i = 0; i < incoming_connections.size(); i++) {
-            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
-            rs << "        if (" << port.name << "_count < " << port.name << "_ntiles) {\n";
-            rs << "            cb_reserve_back(" << port.name << ", 1);\n";
-            rs << "        }\n";
-        }
-        // Read tile into CB from DRAM.
+        // Each iteration moves up to BATCH_SIZE tiles per port, so that many reads are in flight before each barrier.
         for (size_t i = 0; i < incoming_connections.size(); i++) {
             auto port = kernel->get_input_port(incoming_connections[i].dest.port);
-            rs << "        if (" << port.name << "_count < " << port.name << "_ntiles) {\n";
-            rs << "            uint32_t " << port.name << "_write_ptr = get_write_ptr(" << port.name << ");\n";
-            rs << "            noc_async_read_tile(" << port.name<< "_count, " <<  port.name << "_addr_gen, " << port.name << "_write_ptr);\n";
-            rs << "        }\n";
+            rs << "        uint32_t " << port.name << "_batch = " << port.name << "_ntiles - " << port.name << "_count;\n";
+            rs << "        if (" << port.name << "_batch > BATCH_SIZE) " << port.name << "_batch = BATCH_SIZE;\n";
         }
-        // Wait until tile reads are done.
-        rs << "\n";
-        rs << "        noc_async_read_barrier();\n";
         rs << "\n";
 
-        // Push tiles into CBs and increment counters.
-        // Signals to compute engine that a tile is ready to be processed.
+        emit_batch("            ",
+                   [](const std::string& name) { return name + "_count"; },
+                   [](const std::string& name) { return name + "_batch"; },
+                   [](const std::string& name, const std::string& code) {
+                       return "        if (" + name + "_count < " + name + "_ntiles) {\n" + code + "        }\n";
+                   });
+        // Increment counters.
         for (size_t i = 0; i < incoming_connections.size(); i++) {
             auto port = kernel->get_input_port(incoming_connections[i].dest.port);
             rs << "        if (" << port.name << "_count < " << port.name << "_ntiles) {\n";
-            rs << "            cb_push_back(" << port.name << ", 1);\n";
-            rs << "            " << port.name << "_count++;\n";
+            rs << "            " << port.name << "_count += " << port.name << "_batch;\n";
             rs << "        }\n";
         }
 
         rs << "    }\n";
         // End tile stream loop.
     }
+    if (forwards) {
+        // Make sure all semaphore increments to the kernels we forward to have been issued before exiting.
+        rs << "    noc_async_atomic_barrier();\n";
+    }
+    if (profiling) {
+        rs << "    prof_counters[0] = prof_cycles() - prof_start;\n";
+        rs << "    for (uint32_t c = 0; c < " << PROFILE_COUNTERS << "; c++) {\n";
+        rs << "        prof[2 * c] = prof_counters[c];\n";
+        rs << "        prof[2 * c + 1] = prof_counters[c] >> 32;\n";
+        rs << "    }\n";
+    }
+    if (watchdog) {
+        rs << "    wd[0] = 2;\n";
+    }
 
     rs << "}\n";
     rs << "\n";
 
-    std::string filename = "reader" + std::to_string(get_kernel_index(kernel)) + ".cpp";
-    kernel->generated_reader_kernel_path = GENERATED_KERNELS_PATH / filename;
-    auto reader_kernel_file = std::ofstream(kernel->generated_reader_kernel_path);
-    if (!reader_kernel_file.is_open()) {
-        tt::log_error("[CURRENT] Failed to open file for writing: {}", kernel->generated_reader_kernel_path);
-        exit(1);
-    }
-    reader_kernel_file << rs.str();
-    reader_kernel_file.close();
+    return rs.str();
 }
 
-void Map::generate_compute_device_kernel(
+std::string Map::generate_compute_device_kernel(
     Kernel *kernel,
     std::vector<Connection> incoming_connections,
     std::vector<Connection> outgoing_connections
-) {
+) const {
     std::stringstream cs; 
     // Includes
     cs << "#include \"compute_kernel_api/common.h\"\n";
     cs << "#include \"compute_kernel_api/tile_move_copy.h\"\n";
     cs << "#include \"compute_kernel_api/eltwise_binary.h\"\n";
     cs << "#include \"compute_kernel_api/eltwise_unary/eltwise_unary.h\"\n";
+    cs << "#include \"compute_kernel_api/pack.h\"\n";
     cs << "#include \"compute_kernel_api.h\"\n";
     cs << "#include \"sfpi.h\"\n";
     // cs << "#include \"debug/dprint.h\"\n";
     cs << "\n";
 
+    // Integer ports are exposed to the SFPI body as integer vectors, everything else as floats.
+    auto sfpi_type = [](tt::DataFormat data_format) {
+        switch (data_format) {
+            case tt::DataFormat::Int32: return "vInt";
+            case tt::DataFormat::UInt32: return "vUInt";
+            default: return "vFloat";
+        }
+    };
+    bool reduces = kernel->reduction != Kernel::Reduction::None;
+    // Plain elementwise bodies skip the SFPU and run on the FPU, unpacking straight from the input CBs.
+    auto eltwise = fpu_eltwise(kernel, incoming_connections, outgoing_connections);
+    auto layout = dst_layout(kernel, incoming_connections, outgoing_connections);
+    // SFPI addresses DST by rows, see SFPI_ROWS_PER_TILE. Row i of the tile in `slot`.
+    auto row = [](const std::string& slot) {
+        return "dst_reg[(" + slot + ") * " + std::to_string(SFPI_ROWS_PER_TILE) + " + i]";
+    };
+    std::string row_loop = "    for (int i = 0; i < " + std::to_string(SFPI_ROWS_PER_TILE) + "; i++) {\n";
+    // Parameters come in as floats, and the body sees them as vFloats under their own names.
+    std::string parameter_args;
+    std::string parameter_values;
+    std::string parameter_vars;
+    for (size_t i = 0; i < kernel->parameters.size(); i++) {
+        parameter_args += ", float parameter" + std::to_string(i);
+        parameter_values += ", param" + std::to_string(i) + ".f";
+        parameter_vars += "        vFloat " + kernel->parameters[i].name + " = parameter" + std::to_string(i) + ";\n";
+    }
+
     // SFPU computation
     cs << "namespace sfpi {\n";
     // cs << "template< int ITERATIONS = 16 >\n";
-    cs << "sfpi_inline void compute() {\n";
-    // If we don't have a specifed compute kernel, don't generate anything.
-    if (!kernel->sfpi_kernel_string.empty()) {
+    cs << "sfpi_inline void compute(uint32_t dst_tile" << parameter_args << ") {\n";
+    // If we don't have a specifed compute kernel, don't generate anything. Reductions run their body in reduce() instead.
+    if (!kernel->sfpi_kernel_string.empty() && !reduces && !eltwise) {
         // TODO: Do a better optimization if we don't have a compute kernel.
         // Can probably avoid any call to the sfpi function, don't need to do sfpi init? idk
-        cs << "    for (int i = 0; i < 16; i++) {\n";
+        // One pass over every row of the tile group starting at dst_tile, slots as in dst_layout().
+        cs << row_loop;
+        cs << parameter_vars;
         // Get input variables.
         for (size_t i = 0; i < incoming_connections.size(); i++) {
-            // TODO: Need to figure out the indexing of the dst regs for multiple inputs.
-            cs << "        vFloat in" << i << " = dst_reg[" << i << " * 16 + i];\n";
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            cs << "        " << sfpi_type(port.data_format) << " in" << i << " = " << row("dst_tile + " + std::to_string(layout.input_slots[i])) << ";\n";
         }
         // Declare output variables.
         for (size_t i = 0; i < outgoing_connections.size(); i++) {
-            cs << "        vFloat out" << i << ";\n";
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << "        " << sfpi_type(port.data_format) << " out" << i << ";\n";
         }
         cs << kernel->sfpi_kernel_string;
         // Assign output variables.
         for (size_t i = 0; i < outgoing_connections.size(); i++) {
-            // TODO: Need to figure out the indexing of the dst regs for multiple outputs.
-            cs << "        dst_reg[" << i << " * 16 + i] = out" << i << ";\n";
+            cs << "        " << row("dst_tile + " + std::to_string(layout.output_slots[i])) << " = out" << i << ";\n";
         }
         cs << "    }\n";
 
@@ -509,18 +3149,109 @@ void Map::generate_compute_device_kernel(
     // cs << "        dst_reg[i] = out;\n";
     // cs << "    }\n";
     cs << "}\n";
+    if (reduces) {
+        // Reductions keep one accumulator per output in DST slots [0, n_outputs), inputs get copied in right after them.
+        // The body runs on the inputs, then its outputs are folded into the accumulators (or start them off, for the first tile).
+        size_t n_outputs = outgoing_connections.size();
+        cs << "\n";
+        cs << "sfpi_inline void reduce(bool first" << parameter_args << ") {\n";
+        cs << row_loop;
+        cs << parameter_vars;
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            cs << "        " << sfpi_type(port.data_format) << " in" << i << " = " << row(std::to_string(layout.input_slots[i])) << ";\n";
+        }
+        for (size_t i = 0; i < n_outputs; i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << "        " << sfpi_type(port.data_format) << " out" << i << ";\n";
+        }
+        if (kernel->sfpi_kernel_string.empty()) {
+            // Without a body, the inputs themselves get reduced.
+            for (size_t i = 0; i < n_outputs; i++) {
+                cs << "        out" << i << " = in" << i << ";\n";
+            }
+        } else {
+            cs << kernel->sfpi_kernel_string;
+        }
+        for (size_t i = 0; i < n_outputs; i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << "        if (first) {\n";
+            cs << "            " << row(std::to_string(layout.output_slots[i])) << " = out" << i << ";\n";
+            cs << "        } else {\n";
+            cs << "            " << sfpi_type(port.data_format) << " acc" << i << " = " << row(std::to_string(layout.output_slots[i])) << ";\n";
+            if (kernel->reduction == Kernel::Reduction::Max) {
+                cs << "            v_if (out" << i << " > acc" << i << ") {\n";
+                cs << "                acc" << i << " = out" << i << ";\n";
+                cs << "            }\n";
+                cs << "            v_endif;\n";
+            } else {
+                cs << "            acc" << i << " = acc" << i << " + out" << i << ";\n";
+            }
+            cs << "            " << row(std::to_string(layout.output_slots[i])) << " = acc" << i << ";\n";
+            cs << "        }\n";
+        }
+        cs << "    }\n";
+        cs << "}\n";
+        if (kernel->reduction == Kernel::Reduction::Mean) {
+            cs << "\n";
+            cs << "sfpi_inline void scale(float s) {\n";
+            cs << "    vFloat factor = s;\n";
+            cs << row_loop;
+            for (size_t i = 0; i < n_outputs; i++) {
+                cs << "        vFloat acc" << i << " = " << row(std::to_string(layout.output_slots[i])) << ";\n";
+                cs << "        " << row(std::to_string(layout.output_slots[i])) << " = acc" << i << " * factor;\n";
+            }
+            cs << "    }\n";
+            cs << "}\n";
+        }
+    }
     cs << "}\n";
     cs << "\n";
 
+    if (profiling) {
+        cs << "inline uint64_t prof_cycles() { uint32_t lo = ckernel::reg_read(RISCV_DEBUG_REG_WALL_CLOCK_L); return ((uint64_t)ckernel::reg_read(RISCV_DEBUG_REG_WALL_CLOCK_H) << 32) | lo; }\n";
+        cs << "inline void prof_store(volatile uint32_t* prof, uint32_t c, uint64_t value) { prof[2 * c] = value; prof[2 * c + 1] = value >> 32; }\n";
+        cs << "\n";
+    }
+
     // Main function.
     cs << "namespace NAMESPACE {\n";
     cs << "void MAIN {\n";
+    if (profiling) {
+        cs << "    uint64_t prof_start = prof_cycles();\n";
+        cs << "    uint64_t prof_t;\n";
+        cs << "    uint64_t prof_counters[" << PROFILE_COUNTERS << "] = {0};\n";
+    }
 
     // Get kernel args.
     // TODO: Have varying # of tiles for each input port.
     uint32_t total_args = 0;
+    cs << "#ifdef N_TILES\n";
+    cs << "    constexpr uint32_t n_tiles = N_TILES;\n";
+    cs << "#else\n";
     cs << "    uint32_t n_tiles = get_arg_val<uint32_t>(" << total_args << ");\n";
+    cs << "#endif\n";
     total_args++;
+    // The rest come after the # of tiles of every input port.
+    uint32_t extra_args = incoming_connections.size();
+    if (kernel->reduction == Kernel::Reduction::Mean) {
+        // 1 / (# of tiles per output tile), as float bits.
+        cs << "    union { uint32_t u; float f; } mean_scale = {get_arg_val<uint32_t>(" << extra_args << ")};\n";
+        extra_args++;
+    }
+    for (size_t i = 0; i < kernel->parameters.size(); i++) {
+        cs << "    union { uint32_t u; float f; } param" << i << " = {get_arg_val<uint32_t>(" << extra_args << ")};\n";
+        extra_args++;
+    }
+    if (profiling) {
+        cs << "    volatile uint32_t* prof = reinterpret_cast<volatile uint32_t*>(get_arg_val<uint32_t>(" << extra_args << "));\n";
+        extra_args++;
+    }
+    if (watchdog) {
+        cs << "    volatile uint32_t* wd = reinterpret_cast<volatile uint32_t*>(get_arg_val<uint32_t>(" << extra_args << "));\n";
+        cs << "    PACK((wd[0] = 1));\n";
+        extra_args++;
+    }
     cs << "\n";
 
     // CBs we are going to use.
@@ -547,146 +3278,326 @@ void Map::generate_compute_device_kernel(
 
 
 
-    // Initialize SFPU.
-    for (size_t i = 0; i < incoming_connections.size(); i++) {
-        auto port = kernel->get_input_port(incoming_connections[i].dest.port);
-        cs << "    init_sfpu(" << port.name << ");\n";
+    // Names of the FPU op and the CBs it reads from.
+    std::string fpu_op;
+    std::string lhs;
+    std::string rhs;
+    if (eltwise) {
+        lhs = incoming_connections[eltwise->lhs].dest.port;
+        rhs = incoming_connections[eltwise->rhs].dest.port;
+        switch (eltwise->op) {
+            case Kernel::EltwiseOp::Copy: fpu_op = "copy"; break;
+            case Kernel::EltwiseOp::Add: fpu_op = "add"; break;
+            case Kernel::EltwiseOp::Sub: fpu_op = "sub"; break;
+            case Kernel::EltwiseOp::Mul: fpu_op = "mul"; break;
+        }
+    }
+
+    if (eltwise && eltwise->op == Kernel::EltwiseOp::Copy) {
+        // Only the copied input ever gets unpacked.
+        cs << "    init_sfpu(" << lhs << ");\n";
+    } else if (eltwise) {
+        // Unpacks lhs into SRCA and rhs into SRCB, each in its own format.
+        auto output = outgoing_connections[0].source.port;
+        cs << "    binary_op_init_common(" << lhs << ", " << rhs << ", " << output << ");\n";
+        cs << "    " << fpu_op << "_tiles_init(" << lhs << ", " << rhs << ");\n";
+    } else {
+        // Initialize SFPU.
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            cs << "    init_sfpu(" << port.name << ");\n";
+        }
     }
     cs << "\n";
 
+    // Batching and DST tiling come in as compile-time args, see dst_layout().
+    cs << "    constexpr uint32_t BATCH_SIZE = get_compile_time_arg_val(0);\n";
+    cs << "    constexpr uint32_t TILES_PER_ACQUIRE = get_compile_time_arg_val(1);\n";
+    cs << "    constexpr uint32_t DST_SLOTS_PER_TILE = get_compile_time_arg_val(2);\n";
+    if (reduces) {
+        cs << "    constexpr uint32_t WINDOW = get_compile_time_arg_val(3); // Input tiles per output tile, 0 for all of them.\n";
+    }
+    cs << "\n";
+
+    /**
+    * Copies a single tile from the specified input CB and writes the result to
+    * DST at a specified index. The function will employ unpacker to first unpack into SRC
+    * registers and then perform move into DST registers, at a specified index.
+    * For the in_tile_index to be valid for this call, cb_wait_front(n) had to be
+    * previously called to ensure that at least some number n>0 of tiles are available
+    * in the input CB. The CB index 0 then references the first tile in the received section of the CB,
+    * up to index n-1 (in a FIFO order). The DST register buffer must be in acquired state via
+    * acquire_dst call. This call is blocking and is only available on the compute
+    * engine.
+    *
+    * Return value: None
+    *
+    * | Argument       | Description                                       | Data type | Valid range                                         | required |
+    * |----------------|---------------------------------------------------|-----------|-----------------------------------------------------|----------|
+    * | in_cb_id       | The identifier of the source circular buffer (CB) | uint32_t  | 0 to 31                                             | Yes      |
+    * | in_tile_index  | The index of the tile to copy from the input CB   | uint32_t  | Must be less than the size of the CB                | Yes      |
+    * | dst_tile_index | The index of the tile in the DST register         | uint32_t  | Must be less than the size of the DST register (16) | Yes      |
+    * */
+    // Copies tile `index` of every input into its slot of the tile group starting at DST slot `base`.
+    // The unpacker converts from the port's format into DST. If ports differ in format,
+    // it gets reconfigured going from one port to the next (wrapping around to the last port).
+    auto copy_inputs = [&](const std::string& indent, const std::string& index, const std::string& base) {
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            auto port = kernel->get_input_port(incoming_connections[i].dest.port);
+            auto prev = kernel->get_input_port(incoming_connections[(i + incoming_connections.size() - 1) % incoming_connections.size()].dest.port);
+            if (prev.data_format != port.data_format) {
+                cs << indent << "copy_tile_to_dst_init_short_with_dt(" << prev.name << ", " << port.name << ");\n";
+            }
+            cs << indent << "copy_tile(" << port.name << ", " << index << ", " << base << " + " << layout.input_slots[i] << ");\n";
+        }
+    };
+    // Packs every output's slot of the tile group starting at `base`. Same as above for the packer, converting from DST into each output port's format.
+    auto pack_outputs = [&](const std::string& indent, const std::string& base) {
+        for (size_t i = 0; i < outgoing_connections.size(); i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            auto prev = kernel->get_output_port(outgoing_connections[(i + outgoing_connections.size() - 1) % outgoing_connections.size()].source.port);
+            if (prev.data_format != port.data_format) {
+                cs << indent << "pack_reconfig_data_format(" << prev.name << ", " << port.name << ");\n";
+            }
+            cs << indent << "pack_tile(" << base << " + " << layout.output_slots[i] << ", " << port.name << ");\n";
+        }
+    };
+    // Hands the single reduced tile of every output over to the writer.
+    auto emit_reduced_output = [&](const std::string& indent) {
+        if (kernel->reduction == Kernel::Reduction::Mean) {
+            cs << indent << "MATH((sfpi::scale(mean_scale.f)));\n";
+        }
+        cs << indent << "tile_regs_commit();\n";
+        cs << indent << "tile_regs_wait();\n";
+        for (size_t i = 0; i < outgoing_connections.size(); i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << instrument_wait(indent, "cb_reserve_back(" + port.name + ", 1);", 3 + 2 * i, WatchdogWait::CbFull, i, "PACK");
+        }
+        pack_outputs(indent, "0");
+        for (size_t i = 0; i < outgoing_connections.size(); i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << indent << "cb_push_back(" << port.name << ", 1);\n";
+            cs << watchdog_tiles(indent, WATCHDOG_OUTPUT_TILES + i, "1", "PACK");
+        }
+        cs << indent << "tile_regs_release();\n";
+    };
+
+    if (reduces && kernel->reduction_window == 0) {
+        // Whole stream reduction: DST stays acquired for the whole stream, and the accumulators only get packed at the very end.
+        cs << "    tile_regs_acquire();\n";
+    }
+
     // Tile stream loop
     // TODO: Right now just going to assume that all streams have the same number of tiles.
-    cs << "    for(uint32_t i = 0; i < n_tiles; i++) {\n";
+    cs << "    for(uint32_t i = 0; i < n_tiles; i += BATCH_SIZE) {\n";
+    cs << "#ifdef FULL_BATCHES\n";
+    cs << "        constexpr uint32_t batch = BATCH_SIZE;\n";
+    cs << "#else\n";
+    cs << "        uint32_t batch = n_tiles - i;\n";
+    cs << "        if (batch > BATCH_SIZE) batch = BATCH_SIZE;\n";
+    cs << "#endif\n";
     // Wait for tiles to be read in CBs.
     for (size_t i = 0; i < incoming_connections.size(); i++) {
         auto port = kernel->get_input_port(incoming_connections[i].dest.port);
-        cs << "        cb_wait_front(" << port.name << ", 1);\n";
+        cs << instrument_wait("        ", "cb_wait_front(" + port.name + ", batch);", 2 + 2 * i, WatchdogWait::CbEmpty, i, "UNPACK");
     }
     cs << "\n";
 
-    // Copy tiles from CBs to SFPU registers.
-    for (size_t i = 0; i < incoming_connections.size(); i++) {
-        auto port = kernel->get_input_port(incoming_connections[incoming_connections.size() - i - 1].dest.port);
-        /**
-        * Copies a single tile from the specified input CB and writes the result to
-        * DST at a specified index. The function will employ unpacker to first unpack into SRC
-        * registers and then perform move into DST registers, at a specified index.
-        * For the in_tile_index to be valid for this call, cb_wait_front(n) had to be
-        * previously called to ensure that at least some number n>0 of tiles are available
-        * in the input CB. The CB index 0 then references the first tile in the received section of the CB,
-        * up to index n-1 (in a FIFO order). The DST register buffer must be in acquired state via
-        * acquire_dst call. This call is blocking and is only available on the compute
-        * engine.
-        *
-        * Return value: None
-        *
-        * | Argument       | Description                                       | Data type | Valid range                                         | required |
-        * |----------------|---------------------------------------------------|-----------|-----------------------------------------------------|----------|
-        * | in_cb_id       | The identifier of the source circular buffer (CB) | uint32_t  | 0 to 31                                             | Yes      |
-        * | in_tile_index  | The index of the tile to copy from the input CB   | uint32_t  | Must be less than the size of the CB                | Yes      |
-        * | dst_tile_index | The index of the tile in the DST register         | uint32_t  | Must be less than the size of the DST register (16) | Yes      |
-        * */
-        cs << "        copy_tile(" << port.name << ", 0, " << incoming_connections.size() - i - 1 << ");\n";
+    if (reduces && kernel->reduction_window == 0) {
+        cs << "        for (uint32_t t = 0; t < batch; t++) {\n";
+        copy_inputs("            ", "t", "0");
+        cs << "            MATH((sfpi::reduce(i + t == 0" << parameter_values << ")));\n";
+        cs << "        }\n";
+    } else if (reduces) {
+        // Every WINDOW input tiles get reduced into one output tile.
+        cs << "        for (uint32_t j = 0; j < batch; j += WINDOW) {\n";
+        cs << "            tile_regs_acquire();\n";
+        cs << "            for (uint32_t w = 0; w < WINDOW; w++) {\n";
+        copy_inputs("                ", "j + w", "0");
+        cs << "                MATH((sfpi::reduce(w == 0" << parameter_values << ")));\n";
+        cs << "            }\n";
+        emit_reduced_output("            ");
+        cs << "        }\n";
+    } else {
+        cs << "        for (uint32_t j = 0; j < batch; j += TILES_PER_ACQUIRE) {\n";
+        cs << "            uint32_t n = batch - j;\n";
+        cs << "            if (n > TILES_PER_ACQUIRE) n = TILES_PER_ACQUIRE;\n";
+        cs << "\n";
+        cs << "            tile_regs_acquire();\n";
+        cs << "            for (uint32_t t = 0; t < n; t++) {\n";
+        if (eltwise && eltwise->op == Kernel::EltwiseOp::Copy) {
+            cs << "                copy_tile(" << lhs << ", j + t, t * DST_SLOTS_PER_TILE + " << layout.output_slots[0] << ");\n";
+        } else if (eltwise) {
+            cs << "                " << fpu_op << "_tiles(" << lhs << ", " << rhs << ", j + t, j + t, t * DST_SLOTS_PER_TILE + " << layout.output_slots[0] << ");\n";
+        } else {
+            // Copy tiles from CBs to SFPU registers.
+            copy_inputs("                ", "j + t", "t * DST_SLOTS_PER_TILE");
+            cs << "                MATH((sfpi::compute(t * DST_SLOTS_PER_TILE" << parameter_values << ")));\n";
+        }
+        cs << "            }\n";
+        cs << "            tile_regs_commit();\n";
+        cs << "\n";
+
+        // Packer waits here until the SFPU is done.
+        cs << "            tile_regs_wait();\n";
+        // Reserve space in output CBs.
+        for (size_t i = 0; i < outgoing_connections.size(); i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << instrument_wait("            ", "cb_reserve_back(" + port.name + ", n);", 3 + 2 * i, WatchdogWait::CbFull, i, "PACK");
+        }
+        // Pack tiles into output CBs.
+        cs << "            for (uint32_t t = 0; t < n; t++) {\n";
+        pack_outputs("                ", "t * DST_SLOTS_PER_TILE");
+        cs << "            }\n";
+        // Announce that the output tiles are ready.
+        for (size_t i = 0; i < outgoing_connections.size(); i++) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            cs << "            cb_push_back(" << port.name << ", n);\n";
+            cs << watchdog_tiles("            ", WATCHDOG_OUTPUT_TILES + i, "n", "PACK");
+        }
+        // Packer releases the SFPU registers.
+        cs << "            tile_regs_release();\n";
+        cs << "        }\n";
     }
     cs << "\n";
-    cs << "        tile_regs_acquire();\n";
-    cs << "        MATH((sfpi::compute()));\n";
-    cs << "        tile_regs_commit();\n";
-    cs << "\n";
-    // Computation finished, pop tiles from input CBs
-    // TODO: This may be able to be re-ordered?
+
+    // Computation finished, pop the batch from input CBs
     for (size_t i = 0; i < incoming_connections.size(); i++) {
         auto port = kernel->get_input_port(incoming_connections[i].dest.port);
-        cs << "        cb_pop_front(" << port.name << ", 1);\n";
+        cs << "        cb_pop_front(" << port.name << ", batch);\n";
+        cs << watchdog_tiles("        ", WATCHDOG_INPUT_TILES + i, "batch", "UNPACK");
     }
-    cs << "\n";
 
-    // Packer waits here until the SFPU is done.
-    cs << "        tile_regs_wait();\n";
-    // Reserve space in output CBs.
-    for (size_t i = 0; i < outgoing_connections.size(); i++) {
-        auto port = kernel->get_output_port(outgoing_connections[i].source.port);
-        cs << "        cb_reserve_back(" << port.name << ", 1);\n";
+    // End tile stream loop.
+    cs << "    }\n";
+    if (reduces && kernel->reduction_window == 0) {
+        emit_reduced_output("    ");
     }
-    cs << "\n";
-    // Pack tiles into output CBs.
-    for (size_t i = 0; i < outgoing_connections.size(); i++) {
-        auto port = kernel->get_output_port(outgoing_connections[i].source.port);
-        cs << "        pack_tile(" << i << ", " << port.name << ");\n";
+    if (profiling) {
+        // All three TRISCs run this code, but the unpacker is the one that waits on inputs
+        // and the packer is the one that waits on outputs, so each stores what it measured.
+        cs << "    MATH((prof_store(prof, 0, prof_cycles() - prof_start)));\n";
+        for (size_t i = 0; i < incoming_connections.size(); i++) {
+            cs << "    UNPACK((prof_store(prof, " << 2 + 2 * i << ", prof_counters[" << 2 + 2 * i << "])));\n";
+        }
+        for (size_t i = 0; i < outgoing_connections.size(); i++) {
+            cs << "    PACK((prof_store(prof, " << 3 + 2 * i << ", prof_counters[" << 3 + 2 * i << "])));\n";
+        }
     }
-    cs << "\n";
-    // Announce that the output tiles are ready.
-    for (size_t i = 0; i < outgoing_connections.size(); i++) {
-        auto port = kernel->get_output_port(outgoing_connections[i].source.port);
-        cs << "        cb_push_back(" << port.name << ", 1);\n";
+    if (watchdog) {
+        // The packer is the last one done.
+        cs << "    PACK((wd[0] = 2));\n";
     }
-    cs << "\n";
-
-    // Packer releases the SFPU registers.
-    cs << "        tile_regs_release();\n";
-
-    // End tile stream loop.
-    cs << "    }\n";
 
     // End main.
     cs << "}\n";
     cs << "}\n";
     cs << "\n";
 
-    // Save to file.
-    std::string filename = "compute" + std::to_string(get_kernel_index(kernel)) + ".cpp";
-    kernel->generated_compute_kernel_path = GENERATED_KERNELS_PATH / filename;
-    auto compute_kernel_file = std::ofstream(kernel->generated_compute_kernel_path);
-    if (!compute_kernel_file.is_open()) {
-        tt::log_error("[CURRENT] Failed to open file for writing: {}", kernel->generated_compute_kernel_path);
-        exit(1);
-    }
-    compute_kernel_file << cs.str();
-    compute_kernel_file.close();
+    return cs.str();
 }
 
-void Map::generate_writer_device_kernel(
+std::string Map::generate_writer_device_kernel(
     Kernel *kernel,
     std::vector<Connection> outgoing_connections
-) {
+) const {
 
     std::stringstream ws;
     // Includes.
     ws << "#include <cstdint>\n";
+    ws << "#include \"dataflow_api.h\"\n";
     ws << "\n";
 
+    if (profiling) {
+        ws << "inline uint64_t prof_cycles() { uint32_t lo = reg_read(RISCV_DEBUG_REG_WALL_CLOCK_L); return ((uint64_t)reg_read(RISCV_DEBUG_REG_WALL_CLOCK_H) << 32) | lo; }\n";
+        ws << "\n";
+    }
+
     // Main 
     ws << "void kernel_main() {\n";
+    if (profiling) {
+        ws << "    uint64_t prof_start = prof_cycles();\n";
+        ws << "    uint64_t prof_t;\n";
+        ws << "    uint64_t prof_counters[" << PROFILE_COUNTERS << "] = {0};\n";
+    }
 
     // Writer params from kernel args
     uint32_t total_args = 0;
     for (size_t i = 0; i < outgoing_connections.size(); i++) {
         auto connection = outgoing_connections[i];
+        auto port = kernel->get_output_port(connection.source.port);
+        // Total # of tiles this kernel will write to this port.
+        ws << "#ifdef N_TILES\n";
+        ws << "    constexpr uint32_t " << port.name << "_ntiles = N_TILES;\n";
+        ws << "#else\n";
+        ws << "    uint32_t " << port.name << "_ntiles = get_arg_val<uint32_t>(" << total_args << ");\n";
+        ws << "#endif\n";
+        total_args++;
+        ws << "    constexpr uint32_t " << port.name << "_tile_bytes = get_compile_time_arg_val(" << 1 + i << ");\n";
         if (connection.dest.is_stream()) {
             // TODO: Here we are using the capacity of the stream we are writing to in order to determine how many tiles we need to write.
             // The issue with this is that if compute does any sort of reduction, then the capacity of the stream will be incorrect (unless it's explicitly set to match).
             // Need to think about how to do this automatically (e.g analyzing the # of tiles we stream in and out for each tile).
             auto stream = streams[connection.dest.index];
-            // Kernel -> Stream, get the output port index.
-            auto port = kernel->get_output_port(connection.source.port);
-            // Total # of tiles this kernel will write to this stream.
-            ws << "    uint32_t " << port.name << "_ntiles = get_arg_val<uint32_t>(" << total_args << ");\n";
+            // Index of the first tile of the slice this replica is responsible for.
+            ws << "    uint32_t " << port.name << "_tile_offset = get_arg_val<uint32_t>(" << total_args << ");\n";
+            total_args++;
+            // Tiles between the starts of two consecutive batches of this replica.
+            ws << "    uint32_t " << port.name << "_tile_stride = get_arg_val<uint32_t>(" << total_args << ");\n";
             total_args++;
             // For every outgoing stream connection, we need to get it's address and create an address generator.
             ws << "    uint32_t " << port.name << "_addr = get_arg_val<uint32_t>(" << total_args << ");\n";
             total_args++;
             // Address generator.
             // TODO: Do we need this? How does this even work?
-            ws << "    const InterleavedAddrGenFast<true> " << port.name << "_addr_gen = {\n";
+            ws << "    const InterleavedAddrGenFast<" << (stream->memory == Stream::Memory::Dram ? "true" : "false") << "> " << port.name << "_addr_gen = {\n";
             ws << "        .bank_base_address = " << port.name << "_addr, \n";
-            ws << "        .page_size = " << TILE_WIDTH * TILE_HEIGHT * stream->element_size << ", \n";
+            ws << "        .page_size = " << port.name << "_tile_bytes, \n";
             ws << "        .data_format = " << data_format_to_string(stream->data_format) << ", \n";
             ws << "    };\n\n";
         } else {
-            // TODO: Handle outgoing kernel connections.
+            // Kernel -> Kernel. The downstream reader tells us where to write each batch via our sender semaphore,
+            // and we signal it through its receiver semaphore once the batch has landed.
+            // If there's more consumer replicas than producer replicas, we feed each of them in turn
+            // and pass the turn on to the next one as soon as we know where the current batch goes.
+            auto consumer = kernels[connection.dest.index];
+            auto n_receivers = connected_replicas(kernel->num_replicas, consumer->num_replicas, 0).size();
+            ws << "    volatile tt_l1_ptr uint32_t* " << port.name << "_sender_sem = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_semaphore(get_arg_val<uint32_t>(" << total_args << ")));\n";
+            total_args++;
+            ws << "    uint32_t " << port.name << "_receiver_sem_addr = get_semaphore(get_arg_val<uint32_t>(" << total_args << "));\n";
+            total_args++;
+            if (consumer->num_replicas > kernel->num_replicas) {
+                ws << "    uint32_t " << port.name << "_turn_sem_addr = get_semaphore(get_arg_val<uint32_t>(" << total_args << "));\n";
+                total_args++;
+            }
+            ws << "    constexpr uint32_t " << port.name << "_n_receivers = " << n_receivers << ";\n";
+            ws << "    uint32_t " << port.name << "_receiver_noc_x[" << port.name << "_n_receivers];\n";
+            ws << "    uint32_t " << port.name << "_receiver_noc_y[" << port.name << "_n_receivers];\n";
+            for (size_t r = 0; r < n_receivers; r++) {
+                ws << "    " << port.name << "_receiver_noc_x[" << r << "] = get_arg_val<uint32_t>(" << total_args << ");\n";
+                ws << "    " << port.name << "_receiver_noc_y[" << r << "] = get_arg_val<uint32_t>(" << total_args + 1 << ");\n";
+                total_args += 2;
+            }
+            if (consumer->num_replicas > kernel->num_replicas) {
+                // The first receiver gets the first turn.
+                ws << "    if (" << port.name << "_ntiles > 0) {\n";
+                ws << "        noc_semaphore_inc(get_noc_addr(" << port.name << "_receiver_noc_x[0], " << port.name << "_receiver_noc_y[0], " << port.name << "_turn_sem_addr), 1);\n";
+                ws << "    }\n";
+            }
+            ws << "\n";
         }
     }
 
+    if (profiling) {
+        ws << "    volatile tt_l1_ptr uint32_t* prof = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_arg_val<uint32_t>(" << total_args << "));\n\n";
+        total_args++;
+    }
+    if (watchdog) {
+        ws << "    volatile tt_l1_ptr uint32_t* wd = reinterpret_cast<volatile tt_l1_ptr uint32_t*>(get_arg_val<uint32_t>(" << total_args << "));\n";
+        ws << "    wd[0] = 1;\n\n";
+        total_args++;
+    }
+
     // Circular buffers.
     uint32_t num_output_cbs = OUT_CB_START; // Output CBs start at index 16.
     for (size_t i = 0; i < outgoing_connections.size(); i++) {
@@ -701,22 +3612,56 @@ void Map::generate_writer_device_kernel(
     // TODO: Handle multiple output ports with DIFFERENT n_tiles.
     // In the loop, need to keep track of how many tiles we've written to each output port.
     // Break condition is when we've written the expected # of tiles to each output port.
-    ws << "    for(uint32_t i = 0; i < " << outgoing_connections[0].source.port << "_ntiles; i++) {\n";
+    ws << "    constexpr uint32_t BATCH_SIZE = get_compile_time_arg_val(0);\n";
+    ws << "    for(uint32_t i = 0; i < " << outgoing_connections[0].source.port << "_ntiles; i += BATCH_SIZE) {\n";
+    ws << "#ifdef FULL_BATCHES\n";
+    ws << "        constexpr uint32_t batch = BATCH_SIZE;\n";
+    ws << "#else\n";
+    ws << "        uint32_t batch = " << outgoing_connections[0].source.port << "_ntiles - i;\n";
+    ws << "        if (batch > BATCH_SIZE) batch = BATCH_SIZE;\n";
+    ws << "#endif\n";
+    ws << "        uint32_t n_batch = i / BATCH_SIZE;\n";
     // Wait tiles to arrive in CBs
     for (size_t i = 0; i < outgoing_connections.size(); i++) {
         auto port = kernel->get_output_port(outgoing_connections[i].source.port);
-        ws << "        cb_wait_front(" << port.name << ", 1);\n";
+        ws << instrument_wait("        ", "cb_wait_front(" + port.name + ", batch);", 2 + 2 * i, WatchdogWait::CbEmpty, i);
     }
 
-    // Write tiles to DRAM.
+    // Write tiles to DRAM, or into the downstream kernel's CB.
     for (size_t i = 0; i < outgoing_connections.size(); i++) {
         auto port = kernel->get_output_port(outgoing_connections[i].source.port);
         ws << "        uint32_t " << port.name << "_read_ptr = get_read_ptr(" << port.name << ");\n";
-        ws << "        noc_async_write_tile(i, " << port.name << "_addr_gen, " << port.name << "_read_ptr);\n";
+        if (outgoing_connections[i].dest.is_stream()) {
+            ws << "#pragma GCC unroll 16\n";
+            ws << "        for (uint32_t j = 0; j < batch; j++) {\n";
+            ws << "            noc_async_write_tile(" << port.name << "_tile_offset + n_batch * " << port.name << "_tile_stride + j, " << port.name << "_addr_gen, " << port.name << "_read_ptr + j * " << port.name << "_tile_bytes);\n";
+            ws << "        }\n";
+        } else {
+            // Wait for the downstream reader to hand us the free slots in its CB.
+            // The whole batch is contiguous in both CBs, so it goes out as a single write.
+            ws << "        uint32_t " << port.name << "_dst = n_batch % " << port.name << "_n_receivers;\n";
+            ws << instrument_wait("        ", "while (*" + port.name + "_sender_sem == 0);", 3 + 2 * i, WatchdogWait::Downstream, i);
+            ws << "        uint32_t " << port.name << "_dst_addr = *" << port.name << "_sender_sem;\n";
+            ws << "        noc_semaphore_set(" << port.name << "_sender_sem, 0);\n";
+            if (kernels[outgoing_connections[i].dest.index]->num_replicas > kernel->num_replicas) {
+                ws << "        if (i + BATCH_SIZE < " << port.name << "_ntiles) {\n";
+                ws << "            uint32_t " << port.name << "_next = (" << port.name << "_dst + 1) % " << port.name << "_n_receivers;\n";
+                ws << "            noc_semaphore_inc(get_noc_addr(" << port.name << "_receiver_noc_x[" << port.name << "_next], " << port.name << "_receiver_noc_y[" << port.name << "_next], " << port.name << "_turn_sem_addr), 1);\n";
+                ws << "        }\n";
+            }
+            ws << "        noc_async_write(" << port.name << "_read_ptr, get_noc_addr(" << port.name << "_receiver_noc_x[" << port.name << "_dst], " << port.name << "_receiver_noc_y[" << port.name << "_dst], " << port.name << "_dst_addr), batch * " << port.name << "_tile_bytes);\n";
+        }
     }
     // Wait until tile writes are done.
     ws << "\n";
-    ws << "        noc_async_write_barrier();\n";
+    ws << instrument_wait("        ", "noc_async_write_barrier();", 1, WatchdogWait::Barrier, 0);
+    // Tiles have landed, let downstream kernels know.
+    for (size_t i = 0; i < outgoing_connections.size(); i++) {
+        if (outgoing_connections[i].dest.is_kernel()) {
+            auto port = kernel->get_output_port(outgoing_connections[i].source.port);
+            ws << "        noc_semaphore_inc(get_noc_addr(" << port.name << "_receiver_noc_x[" << port.name << "_dst], " << port.name << "_receiver_noc_y[" << port.name << "_dst], " << port.name << "_receiver_sem_addr), 1);\n";
+        }
+    }
     ws << "\n";
     // // TODO: Potentially slower than just using noc_async_write_flushed().
     // // Might not even have to use until the last tile is written.
@@ -724,37 +3669,95 @@ void Map::generate_writer_device_kernel(
     // Mark the tiles as consumed.
     for (size_t i = 0; i < outgoing_connections.size(); i++) {
         auto port = kernel->get_output_port(outgoing_connections[i].source.port);
-        ws << "        cb_pop_front(" << port.name << ", 1);\n";
+        ws << "        cb_pop_front(" << port.name << ", batch);\n";
+        ws << watchdog_tiles("        ", WATCHDOG_OUTPUT_TILES + i, "batch");
     }
     ws << "    }\n";
     // End tile stream loop.
+    // Make sure all semaphore increments to downstream kernels have been issued before exiting.
+    ws << "    noc_async_atomic_barrier();\n";
+    if (profiling) {
+        ws << "    prof_counters[0] = prof_cycles() - prof_start;\n";
+        ws << "    for (uint32_t c = 0; c < " << PROFILE_COUNTERS << "; c++) {\n";
+        ws << "        prof[2 * c] = prof_counters[c];\n";
+        ws << "        prof[2 * c + 1] = prof_counters[c] >> 32;\n";
+        ws << "    }\n";
+    }
+    if (watchdog) {
+        ws << "    wd[0] = 2;\n";
+    }
 
     //End Main
     ws << "}\n";
     ws << "\n";
 
-    // Save to file.
-    std::string filename = "writer" + std::to_string(get_kernel_index(kernel)) + ".cpp";
-    kernel->generated_writer_kernel_path = GENERATED_KERNELS_PATH / filename;
-    auto writer_kernel_file = std::ofstream(kernel->generated_writer_kernel_path);
-    if (!writer_kernel_file.is_open()) {
-        tt::log_error("[CURRENT] Failed to open file for writing: {}", kernel->generated_writer_kernel_path);
-        exit(1);
-    }
-    writer_kernel_file << ws.str();
-    writer_kernel_file.close();
+    return ws.str();
 }
 
 void Map::generate_device_kernels() {
-    for (int i = 0; i < kernels.size(); i++) {
-        Kernel *kernel = kernels[i];
-        auto incoming_connections = get_incoming_connections(kernel);
-        auto outgoing_connections = get_outgoing_connections(kernel);
+    // Generating the sources only reads the map, so kernels are generated in parallel.
+    // The graph's order is filled in on first use, so do that up front instead of racing on it.
+    order_graph();
+    std::vector<std::array<std::string, 3>> sources(kernels.size());
+    std::atomic<size_t> next_kernel = 0;
+    auto generate = [&]() {
+        for (size_t i = next_kernel++; i < kernels.size(); i = next_kernel++) {
+            Kernel *kernel = kernels[i];
+            auto incoming_connections = get_incoming_connections(kernel);
+            auto outgoing_connections = get_outgoing_connections(kernel);
+            sources[i][0] = generate_reader_device_kernel(kernel, incoming_connections);
+            sources[i][1] = generate_compute_device_kernel(kernel, incoming_connections, outgoing_connections);
+            sources[i][2] = generate_writer_device_kernel(kernel, outgoing_connections);
+        }
+    };
+    size_t num_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), kernels.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; t++) {
+        threads.emplace_back(generate);
+    }
+    generate();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Files are named after a hash of their contents, so structurally identical kernels share a file
+    // and a file keeps its timestamp for as long as its contents don't change.
+    const std::array<std::string, 3> kinds = {"reader", "compute", "writer"};
+    std::unordered_map<std::string, const std::string *> unique_files;
+    for (size_t i = 0; i < kernels.size(); i++) {
+        std::array<std::filesystem::path *, 3> paths = {
+            &kernels[i]->generated_reader_kernel_path,
+            &kernels[i]->generated_compute_kernel_path,
+            &kernels[i]->generated_writer_kernel_path,
+        };
+        for (size_t k = 0; k < kinds.size(); k++) {
+            std::stringstream filename;
+            filename << kinds[k] << "_" << std::hex << std::setw(16) << std::setfill('0') << fnv1a_hash(sources[i][k]) << ".cpp";
+            *paths[k] = GENERATED_KERNELS_PATH / filename.str();
+            unique_files.emplace(paths[k]->string(), &sources[i][k]);
+        }
+    }
 
-        generate_reader_device_kernel(kernel, incoming_connections);
-        generate_compute_device_kernel(kernel, incoming_connections, outgoing_connections);
-        generate_writer_device_kernel(kernel, outgoing_connections);
+    size_t num_written = 0;
+    for (const auto& [path, source] : unique_files) {
+        if (std::filesystem::exists(path)) {
+            std::ifstream existing_file(path);
+            std::stringstream existing;
+            existing << existing_file.rdbuf();
+            if (existing.str() == *source) {
+                continue;
+            }
+        }
+        auto kernel_file = std::ofstream(path);
+        if (!kernel_file.is_open()) {
+            tt::log_error("[CURRENT] Failed to open file for writing: {}", path);
+            exit(1);
+        }
+        kernel_file << *source;
+        kernel_file.close();
+        num_written++;
     }
+    tt::log_info("[CURRENT] Generated {} kernel sources, {} unique, {} written", kernels.size() * kinds.size(), unique_files.size(), num_written);
 }
 
 void Map::export_dot(const std::string& filename) const {
@@ -769,7 +3772,25 @@ void Map::export_dot(const std::string& filename) const {
     
     // Define nodes
     for (size_t i = 0; i < kernels.size(); i++) {
-        dot_file << "    kernel_" << i << " [label=\"Kernel " << i << "\", fillcolor=lightblue];\n";
+        // Once the map has been placed, show which cores each kernel ended up on.
+        std::string placement_label;
+        const auto& cores = kernels[i]->replica_cores;
+        auto core_str = [](const CoreCoord& core) { return "(" + std::to_string(core.x) + "," + std::to_string(core.y) + ")"; };
+        if (cores.size() == 1) {
+            placement_label = "\\n" + core_str(cores[0]);
+        } else if (cores.size() > 1) {
+            placement_label = "\\n" + std::to_string(cores.size()) + " cores: " + core_str(cores.front()) + " .. " + core_str(cores.back());
+        }
+        // Once the map has been profiled, show how long it took and how much of it was spent in NoC barriers.
+        std::string profile_label;
+        if (profile && i < profile->kernels.size()) {
+            const auto& stats = profile->kernels[i];
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(1) << "\\n" << stats.seconds * 1e6 << " us, read barrier " << stats.read_barrier_pct
+               << "%, write barrier " << stats.write_barrier_pct << "%";
+            profile_label = ss.str();
+        }
+        dot_file << "    kernel_" << i << " [label=\"Kernel " << i << placement_label << profile_label << "\", fillcolor=lightblue];\n";
     }
     for (size_t i = 0; i < streams.size(); i++) {
         dot_file << "    stream_" << i << " [label=\"Stream " << i << "\", fillcolor=green];\n";
@@ -793,7 +3814,34 @@ void Map::export_dot(const std::string& filename) const {
                 (conn.dest.port.empty() ? "sink" : conn.dest.port) + "\"]";
         }
         
+        // Profiled edges get the throughput and stalls of the port they come out of (or go into, for stream sources).
+        if (profile) {
+            const ProfileReport::PortProfile *stats = nullptr;
+            const auto& adjacent = conn.source.is_kernel() ? graph.outgoing[conn.source.index] : graph.incoming[conn.dest.index];
+            size_t port_idx = std::find(adjacent.begin(), adjacent.end(), &conn - connections.data()) - adjacent.begin();
+            if (conn.source.is_kernel() && conn.source.index < profile->kernels.size()) {
+                stats = &profile->kernels[conn.source.index].outputs[port_idx];
+            } else if (conn.dest.is_kernel() && conn.dest.index < profile->kernels.size()) {
+                stats = &profile->kernels[conn.dest.index].inputs[port_idx];
+            }
+            if (stats) {
+                std::stringstream ss;
+                ss << std::fixed << std::setprecision(1) << "\\n" << stats->tiles_per_second << " tiles/s, stall full "
+                   << stats->full_stall_pct << "% / empty " << stats->empty_stall_pct << "%";
+                std::string profile_label = ss.str();
+                if (label.empty()) {
+                    label = " [label=\"" + profile_label.substr(2) + "\"]";
+                } else {
+                    label.insert(label.size() - 2, profile_label);
+                }
+            }
+        }
+
         dot_file << "    " << src_name << " -> " << dst_name << label << ";\n";
+        // Shared streams actually reach their followers through the leader's reader.
+        if (auto leader = shared_stream_leader(conn)) {
+            dot_file << "    kernel_" << leader->dest.index << " -> " << dst_name << " [label=\"forwarded\", style=dashed];\n";
+        }
     }
     
     dot_file << "}\n";
@@ -806,58 +3854,184 @@ void Map::check_connections() {
     // Check all kernel ports have connections
     for (size_t kernel_idx = 0; kernel_idx < kernels.size(); kernel_idx++) {
         Kernel* kernel = kernels[kernel_idx];
-        
-        // Check input ports
-        for (const auto& input_port : kernel->input_ports) {
-            bool found = false;
-            for (const auto& conn : connections) {
-                if (conn.dest.is_kernel() && 
-                    conn.dest.index == kernel_idx && 
-                    conn.dest.port == input_port.name) {
-                    found = true;
-                    break;
-                }
+        std::vector<uint32_t> input_connections(kernel->input_ports.size(), 0);
+        std::vector<uint32_t> output_connections(kernel->output_ports.size(), 0);
+        for (size_t c : graph.incoming[kernel_idx]) {
+            uint32_t port_index = kernel->get_input_port_index(connections[c].dest.port);
+            if (port_index >= input_connections.size()) {
+                tt::log_error("[CURRENT] Kernel {} has no input port '{}'", kernel_idx, connections[c].dest.port);
+                flag = true;
+                continue;
             }
-            if (!found) {
-                tt::log_warning("[CURRENT] Kernel {} input port '{}' has no connection", kernel_idx, input_port.name);
+            input_connections[port_index]++;
+        }
+        for (size_t c : graph.outgoing[kernel_idx]) {
+            uint32_t port_index = kernel->get_output_port_index(connections[c].source.port);
+            if (port_index >= output_connections.size()) {
+                tt::log_error("[CURRENT] Kernel {} has no output port '{}'", kernel_idx, connections[c].source.port);
+                flag = true;
+                continue;
             }
+            output_connections[port_index]++;
         }
 
-        // Check output ports
-        for (const auto& output_port : kernel->output_ports) {
-            bool found = false;
-            for (const auto& conn : connections) {
-                if (conn.source.is_kernel() && 
-                    conn.source.index == kernel_idx && 
-                    conn.source.port == output_port.name) {
-                    found = true;
-                    break;
-                }
+        // Check input ports
+        for (size_t i = 0; i < kernel->input_ports.size(); i++) {
+            if (input_connections[i] == 0) {
+                tt::log_warning("[CURRENT] Kernel {} input port '{}' has no connection", kernel_idx, kernel->input_ports[i].name);
+            } else if (input_connections[i] > 1) {
+                // Both would fill the same CB.
+                tt::log_error("[CURRENT] Kernel {} input port '{}' has {} connections", kernel_idx, kernel->input_ports[i].name, input_connections[i]);
+                flag = true;
             }
-            if (!found) {
-                tt::log_warning("[CURRENT] Kernel {} output port '{}' has no connection", kernel_idx, output_port.name);
+        }
+
+        // Check output ports
+        for (size_t i = 0; i < kernel->output_ports.size(); i++) {
+            if (output_connections[i] == 0) {
+                tt::log_warning("[CURRENT] Kernel {} output port '{}' has no connection", kernel_idx, kernel->output_ports[i].name);
                 flag = true;
             }
         }
     }
 
     // Check all streams have connections
+    std::set<const Stream *> viewed;
+    for (const auto stream : streams) {
+        viewed.insert(stream->view_base);
+        viewed.insert(stream->view_indices);
+    }
     for (size_t stream_idx = 0; stream_idx < streams.size(); stream_idx++) {
-        bool found = false;
-        for (const auto& conn : connections) {
-            if ((conn.source.is_stream() && conn.source.index == stream_idx) ||
-                (conn.dest.is_stream() && conn.dest.index == stream_idx)) {
-                found = true;
-                break;
-            }
-        }
+        // Bases of views are read through the view.
+        bool found = is_source_stream(stream_idx) || is_sink_stream(stream_idx) || viewed.contains(streams[stream_idx]);
         if (!found) {
             tt::log_warning("[CURRENT] Stream {} has no connections", stream_idx);
             flag = true;
         }
     }
 
-    assert(!flag && "Missing connections in map!");
+    assert(!flag && "Missing or duplicate connections in map!");
+
+    // Every kernel waits on its upstream kernels' batches, so a cycle would deadlock.
+    order_graph();
+    if (graph.order.size() != kernels.size()) {
+        for (size_t kernel_idx = 0; kernel_idx < kernels.size(); kernel_idx++) {
+            if (graph.rank[kernel_idx] == kernels.size()) {
+                tt::log_error("[CURRENT] Kernel {} is on (or downstream of) a cycle", kernel_idx);
+            }
+        }
+        flag = true;
+    }
+    assert(!flag && "Kernel graph has a cycle!");
+
+    // Sharded streams are laid out for the one kernel reading them.
+    for (size_t stream_idx = 0; stream_idx < streams.size(); stream_idx++) {
+        if (streams[stream_idx]->memory != Stream::Memory::Sharded) {
+            continue;
+        }
+        uint32_t readers = 0;
+        for (size_t c : graph.readers[stream_idx]) {
+            readers += upstream_kernel(connections[c]) == nullptr;
+        }
+        if (!is_source_stream(stream_idx) || is_sink_stream(stream_idx) || readers != 1) {
+            tt::log_error("[CURRENT] Stream {} is sharded, but is not a source read by exactly one kernel", stream_idx);
+            flag = true;
+        }
+    }
+    assert(!flag && "Sharded streams have to be sources read by a single kernel!");
+
+    // Views only ever read their base, which can't be written by the same map.
+    for (size_t stream_idx = 0; stream_idx < streams.size(); stream_idx++) {
+        auto stream = streams[stream_idx];
+        if (!stream->is_view()) {
+            continue;
+        }
+        if (is_sink_stream(stream_idx)) {
+            tt::log_error("[CURRENT] Stream {} is a view, so it can't be a sink", stream_idx);
+            flag = true;
+        }
+        for (auto backing : {stream->view_base, stream->view_indices}) {
+            auto it = graph.stream_index.find(backing);
+            if (backing != nullptr && it != graph.stream_index.end() && is_sink_stream(it->second)) {
+                tt::log_error("[CURRENT] Stream {} is a view of stream {}, which the map writes to", stream_idx, it->second);
+                flag = true;
+            }
+        }
+        if (stream->memory != stream->view_base->memory || stream->view_base->memory == Stream::Memory::Sharded ||
+            (stream->view_indices != nullptr && stream->view_indices->memory == Stream::Memory::Sharded)) {
+            tt::log_error("[CURRENT] Stream {} is a view, it lives wherever its base does, and can't read sharded streams", stream_idx);
+            flag = true;
+        }
+    }
+    assert(!flag && "Invalid stream views!");
+
+    // Every port of a kernel has to agree on how many steps the kernel runs for.
+    for (size_t kernel_idx = 0; kernel_idx < kernels.size(); kernel_idx++) {
+        Kernel* kernel = kernels[kernel_idx];
+        auto incoming_connections = get_incoming_connections(kernel);
+        auto outgoing_connections = get_outgoing_connections(kernel);
+        for (const auto& port : kernel->input_ports) {
+            assert(port.rate == kernel->input_ports[0].rate && "Input ports of a kernel must have the same rate!");
+        }
+        for (const auto& port : kernel->output_ports) {
+            assert(port.rate == kernel->output_ports[0].rate && "Output ports of a kernel must have the same rate!");
+        }
+        if (!kernel->input_ports.empty() && !kernel->output_ports.empty()) {
+            uint32_t in_rate = kernel->input_ports[0].rate;
+            uint32_t out_rate = kernel->output_ports[0].rate;
+            if (kernel->reduction == Kernel::Reduction::None) {
+                // The body maps one input tile to one output tile.
+                assert(in_rate == out_rate && "Kernels without a reduction must have the same input and output rates!");
+            } else if (kernel->reduction_window > 0) {
+                assert(in_rate == kernel->reduction_window * out_rate && "Reduction window must be the ratio of input to output rate!");
+            }
+        }
+        // At least one tile's worth of ports has to fit in DST.
+        auto layout = dst_layout(kernel, incoming_connections, outgoing_connections);
+        uint32_t capacity = dst_capacity(uses_fp32_dest(kernel));
+        if (layout.slots_per_tile > capacity) {
+            tt::log_error("[CURRENT] Kernel {} needs {} DST slots per tile, but only {} fit", kernel_idx, layout.slots_per_tile, capacity);
+            assert(false && "Too many ports for a kernel to fit in DST!");
+        }
+        if (kernel->reduction != Kernel::Reduction::None) {
+            assert((!kernel->sfpi_kernel_string.empty() || kernel->input_ports.size() >= kernel->output_ports.size()) &&
+                   "A reduction without a body needs an input for every output!");
+            for (const auto& port : kernel->output_ports) {
+                bool is_integer = port.data_format == tt::DataFormat::Int32 || port.data_format == tt::DataFormat::UInt32;
+                assert(!(kernel->reduction == Kernel::Reduction::Mean && is_integer) && "Mean reductions need float outputs!");
+            }
+        }
+        std::optional<uint32_t> steps;
+        for (const auto& connection : incoming_connections) {
+            auto port = kernel->get_input_port(connection.dest.port);
+            uint32_t n_tiles = get_n_tiles(connection);
+            if (n_tiles % port.rate != 0 || (steps && *steps != n_tiles / port.rate)) {
+                tt::log_error("[CURRENT] Kernel {} input port '{}' gets {} tiles, which doesn't line up with the other ports at rate {}", kernel_idx, port.name, n_tiles, port.rate);
+                flag = true;
+            }
+            steps = n_tiles / port.rate;
+        }
+    }
+    for (const auto& connection : connections) {
+        if (connection.source.is_kernel() && connection.dest.is_stream()) {
+            // Sinks have to be sized for what actually gets produced.
+            uint32_t n_tiles = get_n_tiles(connection);
+            if (n_tiles != stream_n_tiles(streams[connection.dest.index])) {
+                tt::log_error("[CURRENT] Stream {} holds {} tiles, but kernel {} produces {} tiles", connection.dest.index, stream_n_tiles(streams[connection.dest.index]), connection.source.index, n_tiles);
+                flag = true;
+            }
+        } else if (connection.source.is_kernel() && connection.dest.is_kernel()) {
+            // Batches are handed over as a whole, so both ends have to agree on how many tiles make a batch.
+            auto producer = kernels[connection.source.index];
+            if (!producer->reduces_whole_stream() &&
+                producer->get_output_port(connection.source.port).rate != kernels[connection.dest.index]->get_input_port(connection.dest.port).rate) {
+                tt::log_error("[CURRENT] Kernel {} port '{}' and kernel {} port '{}' are connected but have different rates", connection.source.index, connection.source.port, connection.dest.index, connection.dest.port);
+                flag = true;
+            }
+        }
+    }
+
+    assert(!flag && "Port rates don't line up!");
 }
 
 } // End namespace current
\ No newline at end of file
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <span>
+#include <unordered_map>
 
 #include "impl/buffers/buffer.hpp"
 #include "tt_metal/host_api.hpp"
@@ -19,28 +25,142 @@ using CoreSpec = std::variant<CoreCoord, CoreRange, CoreRangeSet>;
 // Wrapper around a DRAM buffer. Used as source and dest of stream data for kernels.
 class Stream {
   public: 
-    Stream(const std::vector<uint32_t>& initial_data, size_t num_elements, tt::DataFormat data_format) {
-        assert(initial_data.size() * 4 == num_elements * tt::datum_size(data_format) && "Stream data size does not match number of elements!");
-        n_elements = num_elements;
-        host_data = initial_data;
-        this->element_size = tt::datum_size(data_format);
-        this->data_format = data_format;
-        this->n_tiles = std::ceil(n_elements / TILE_SIZE);
+    // Owning, the stream keeps its own copy of the data.
+    Stream(const std::vector<uint32_t>& initial_data, size_t num_elements, tt::DataFormat data_format)
+        : Stream(std::vector<uint32_t>(initial_data), num_elements, data_format) {}
+
+    // Owning, but takes over the caller's vector instead of copying it.
+    Stream(std::vector<uint32_t>&& initial_data, size_t num_elements, tt::DataFormat data_format) {
+        owned_data = std::move(initial_data);
+        init(std::span<uint32_t>(owned_data), num_elements, data_format);
+    }
+
+    // Owning, zero initialized. Handy for sinks.
+    Stream(size_t num_elements, tt::DataFormat data_format) {
+        owned_data.resize(size_in_bytes(num_elements, data_format) / sizeof(uint32_t));
+        init(std::span<uint32_t>(owned_data), num_elements, data_format);
+    }
+
+    // Non-owning. The runtime writes from and reads back into the caller's memory (e.g a pinned buffer)
+    // directly, so it has to outlive any execution using this stream.
+    Stream(std::span<uint32_t> data, size_t num_elements, tt::DataFormat data_format) {
+        init(data, num_elements, data_format);
+    }
+
+    // Owning, packs the values into data_format (Float16_b or Float32) across all host threads.
+    // Float16_b rounds to nearest even.
+    Stream(std::span<const float> values, tt::DataFormat data_format);
+
+    // Streams too big to hold in host memory can be filled and drained a chunk at a time by Map::execute_streaming().
+    // The producer fills the given chunk with the tiles starting at first_tile.
+    // The consumer gets handed each finished chunk of tiles starting at first_tile.
+    using Producer = std::function<void(std::span<uint32_t> chunk, size_t first_tile)>;
+    using Consumer = std::function<void(std::span<const uint32_t> chunk, size_t first_tile)>;
+    static Stream from_producer(Producer producer, size_t num_elements, tt::DataFormat data_format) {
+        return Stream(Chunked{}, num_elements, data_format, std::move(producer), nullptr);
+    }
+    static Stream to_consumer(Consumer consumer, size_t num_elements, tt::DataFormat data_format) {
+        return Stream(Chunked{}, num_elements, data_format, nullptr, std::move(consumer));
+    }
+
+    // Views read another stream's tiles in place, instead of the host copying them into a new stream first.
+    // A view reads n_tiles tiles of base: offset_tiles, offset_tiles + stride_tiles, ... Views of views compose.
+    // A gather reads the tiles of base listed in indices, an UInt32 stream with one tile index per element, which stays on the device.
+    // Views can only be sources. The base (and the indices) don't need to be part of the map, but have to outlive it.
+    static Stream view(Stream& base, size_t offset_tiles, size_t n_tiles, size_t stride_tiles = 1);
+    static Stream gather(Stream& base, Stream& indices);
+
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    // Bytes of host data needed for a stream of num_elements in the given format.
+    // Bfp8_b is only defined for whole tiles, so those streams round up to the next tile.
+    // Host data is in words, so e.g an odd # of Float16_b elements rounds up to the next word.
+    static size_t size_in_bytes(size_t num_elements, tt::DataFormat data_format) {
+        if (data_format == tt::DataFormat::Bfp8_b) {
+            return (num_elements + TILE_SIZE - 1) / TILE_SIZE * tile_size_in_bytes(data_format);
+        }
+        size_t bytes = num_elements * (tile_size_in_bytes(data_format) / TILE_SIZE);
+        return (bytes + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
     }
 
+    // Host side view of the stream's data. For sinks, this is where the results land.
+    std::span<const uint32_t> data() const { return host_data; }
+    // Float versions of the host data, converted across all host threads like the float constructor.
+    // write_floats() repacks a source in place, e.g before the next replay of a captured map. read_floats() unpacks a sink.
+    void write_floats(std::span<const float> values);
+    void read_floats(std::span<float> values) const;
+    std::vector<float> to_floats() const;
+
+    // Whether the runtime copies this stream back to the host after executing, if it's a sink.
+    // Turn off for sinks only needed on the device to skip the read.
+    void set_read_back(bool enable) { read_back = enable; }
+
+    // Where the stream lives on the device. DRAM unless set otherwise.
+    // L1 interleaves its tiles over the L1 of the worker cores, for small streams (lookup tables, weights, constants).
+    // Sharded puts the tiles each replica of the consuming kernel reads into that replica's own L1, so reads never go over the NoC.
+    // Only sources read by a single kernel (see Map::set_stream_sharing()) can be sharded.
+    // Both take L1 away from CBs on every core.
+    enum class Memory { Dram, L1, Sharded };
+    void set_memory(Memory m) { memory = m; }
+
   private:
     friend class Map;
+
+    struct ViewOf {};
+    Stream(ViewOf, Stream& base, Stream *indices, size_t offset_tiles, size_t n_tiles, size_t stride_tiles);
+    bool is_view() const { return view_base != nullptr; }
+
+    // Chunked streams never hold all of their data on the host.
+    struct Chunked {};
+    Stream(Chunked, size_t num_elements, tt::DataFormat data_format, Producer producer, Consumer consumer)
+        : producer(std::move(producer)), consumer(std::move(consumer)) {
+        assert(is_supported_data_format(data_format) && "Unsupported stream data format!");
+        n_elements = num_elements;
+        this->tile_size_bytes = tile_size_in_bytes(data_format);
+        this->data_format = data_format;
+        this->n_tiles = (n_elements + TILE_SIZE - 1) / TILE_SIZE;
+    }
+
+    void init(std::span<uint32_t> data, size_t num_elements, tt::DataFormat data_format) {
+        assert(is_supported_data_format(data_format) && "Unsupported stream data format!");
+        assert(data.size() * 4 == size_in_bytes(num_elements, data_format) && "Stream data size does not match number of elements!");
+        n_elements = num_elements;
+        host_data = data;
+        this->tile_size_bytes = tile_size_in_bytes(data_format);
+        this->data_format = data_format;
+        this->n_tiles = (n_elements + TILE_SIZE - 1) / TILE_SIZE;
+    }
+
+    // Device buffers always hold whole tiles. Except for Bfp8_b, the host data stops short of that
+    // if the elements don't fill the last tile, so copies pad it out with zeros on the way in and drop the padding on the way back.
+    size_t device_words() const { return (size_t)n_tiles * tile_size_bytes / sizeof(uint32_t); }
+
     // Corresponding host data for the buffer. 
     // If this is a source, then the host will initialize this data and the runtime will copy it to the device.
     // If this is a sink, then the runtime will read data from the device into this buffer for the host to read.
+    // Either points into owned_data or into memory owned by the caller.
     // TODO: Might not have to actually do it this way. If instead we have like a 
     // writeStream() and readStream() function, then the Stream class won't actually hold any data (this is what Brook does).
-    std::vector<uint32_t> host_data;  
+    std::span<uint32_t> host_data;
+    std::vector<uint32_t> owned_data;
+    bool read_back = true;
+    Memory memory = Memory::Dram;
+    // Set for views, see view() and gather().
+    Stream *view_base = nullptr;
+    Stream *view_indices = nullptr;
+    uint32_t view_offset = 0;
+    uint32_t view_stride = 1;
+    Producer producer;
+    Consumer consumer;
+    // Ring of DRAM chunks and matching host staging used by Map::execute_streaming().
+    std::array<std::shared_ptr<tt_metal::Buffer>, 2> chunk_buffers;
+    std::array<std::vector<uint32_t>, 2> chunk_staging;
     std::shared_ptr<tt_metal::Buffer> device_buffer;
     uint32_t device_buffer_address;
     tt_metal::CoreCoord device_buffer_noc_coordinates;
     size_t n_elements;   // Number of elements/tokens this stream will produce.
-    size_t element_size; // Size (in bytes) of each element
+    uint32_t tile_size_bytes; // Size (in bytes) of each tile, which is also the page size of the device buffer.
     uint32_t n_tiles;    // Total # of 32x32 tiles this stream will produce.
     tt::DataFormat data_format;
 };
@@ -53,8 +173,13 @@ class Kernel {
         std::string name;
         tt::DataFormat data_format;
         tt_metal::CBHandle cb; // TODO: Do we want ports to have ownership of CBs?
+        uint32_t cb_n_tiles = 0; // Depth of the port's CB, picked by the runtime.
+        uint32_t rate = 1; // # of tiles the port moves per step of the kernel.
     };
 
+    // Elementwise reductions over the tiles coming out of the compute body.
+    enum class Reduction { None, Sum, Max, Mean };
+
     void add_input_port(const std::string& name, tt::DataFormat data_format);
     void add_output_port(const std::string& name, tt::DataFormat data_format);
     uint32_t num_input_ports() const;
@@ -65,40 +190,82 @@ class Kernel {
         sfpi_kernel_string = (last != std::string::npos) ? code.substr(0, last + 1) + "\n\n" : "";
     }
 
-    uint32_t get_input_port_index(std::string port_name) const {
-        for (size_t i = 0; i < input_ports.size(); i++) {
-            if (input_ports[i].name == port_name) {
-                return i;
-            }
-        }
-        return -1;
+    // How many tiles a port consumes or produces per step of the kernel. Every port moves one tile per step by default.
+    // Each port's # of tiles follows from the kernel's inputs and these rates.
+    void set_port_rate(const std::string& name, uint32_t tiles);
+
+    // Combine the body's results for every `window` consecutive input tiles into a single output tile, elementwise.
+    // Sets the input ports' rate to window and the output ports' rate to 1, so the outputs are window times shorter.
+    // A window of 0 reduces the whole stream into a single tile, which keeps the kernel on one core.
+    // Mean needs float outputs.
+    void set_reduction(Reduction op, uint32_t window = 0);
+    bool reduces_whole_stream() const { return reduction != Reduction::None && reduction_window == 0; }
+
+    // Elementwise ops that can run on the FPU straight out of the input CBs, instead of on the SFPU.
+    enum class EltwiseOp { Copy, Add, Sub, Mul };
+    struct Eltwise {
+        EltwiseOp op;
+        uint32_t lhs; // Indices of the inputs (in0, in1, ...) on each side. rhs is unused for Copy.
+        uint32_t rhs;
+    };
+    // Shorthand for a compute kernel of `out0 = in0;` (Copy) or `out0 = in0 <op> in1;`.
+    void set_eltwise_op(EltwiseOp op);
+    // Recognizes compute kernels of that form, with any inputs on either side.
+    // Everything else (and anything the FPU can't do exactly, see Map) runs as SFPI.
+    std::optional<Eltwise> eltwise_op() const;
+
+    // Data-parallel replication. Each replica runs on its own core and batches of tiles are dealt out to replicas round-robin.
+    // AUTO_REPLICAS lets the runtime spread the kernel across whatever cores are left over, weighted by its cost.
+    static constexpr uint32_t AUTO_REPLICAS = 0;
+    void set_num_replicas(uint32_t n) { requested_replicas = n; }
+
+    // Relative cost of processing one tile, e.g. measured by profiling. Heavier kernels get more of the auto replicas.
+    // If it's not set, the cost is estimated from the SFPI body.
+    void set_cost(double c) { cost = c; }
+    double estimated_cost() const;
+
+    // Named scalars the body reads like any other variable, e.g. `out0 = a * in0 + in1;` after set_parameter("a", 2.0f).
+    // They're passed in as runtime args, so changing one doesn't regenerate or recompile anything, and maps still hit the program cache.
+    // Captured maps keep the values they were captured with. Fused kernels take a copy, so set these before Map::fuse_kernels().
+    void set_parameter(const std::string& name, float value);
+    // Lets the SFPU's builtin (LLK) functions trade accuracy for speed (math_approx_mode). Plain SFPI arithmetic isn't affected.
+    void set_math_approx(bool approx) { math_approx = approx; }
+
+    // Library of prebuilt operators, tuned SFPI bodies from in0, in1, ... to out0, with every port in data_format.
+    // Scalars are parameters (see set_parameter()), so every instance of an operator shares the same generated kernels.
+    // approx trades accuracy for speed with shorter polynomials and fewer Newton steps, good to about bfloat16 precision
+    // instead of float32. The bodies don't call any SFPU builtins, so math_approx_mode wouldn't change them and stays off.
+    enum class Compare { Lt, Le, Gt, Ge, Eq, Ne };
+    static Kernel axpy(float a, tt::DataFormat data_format = tt::DataFormat::Float16_b);                      // a * in0 + in1
+    static Kernel scale_bias(float scale, float bias, tt::DataFormat data_format = tt::DataFormat::Float16_b); // scale * in0 + bias
+    static Kernel multiply_add(tt::DataFormat data_format = tt::DataFormat::Float16_b);                      // in0 * in1 + in2
+    static Kernel clamp(float lo, float hi, tt::DataFormat data_format = tt::DataFormat::Float16_b);         // in0 clamped to [lo, hi]
+    static Kernel exp(bool approx = false, tt::DataFormat data_format = tt::DataFormat::Float16_b);
+    static Kernel log(bool approx = false, tt::DataFormat data_format = tt::DataFormat::Float16_b);          // -inf for 0, NaN below
+    static Kernel sigmoid(bool approx = false, tt::DataFormat data_format = tt::DataFormat::Float16_b);
+    static Kernel compare(Compare op, tt::DataFormat data_format = tt::DataFormat::Float16_b);               // in0 <op> in1 ? 1 : 0
+    static Kernel select(Compare op, tt::DataFormat data_format = tt::DataFormat::Float16_b);                // in0 <op> in1 ? in2 : in3
+
+    uint32_t get_input_port_index(const std::string& port_name) const {
+        auto it = input_port_indices.find(port_name);
+        return it != input_port_indices.end() ? it->second : -1;
     }
 
-    Port get_input_port(std::string port_name) const {
-        for (size_t i = 0; i < input_ports.size(); i++) {
-            if (input_ports[i].name == port_name) {
-                return input_ports[i];
-            }
-        }
-        assert(false && "Input port not found!");
+    const Port& get_input_port(const std::string& port_name) const {
+        auto it = input_port_indices.find(port_name);
+        assert(it != input_port_indices.end() && "Input port not found!");
+        return input_ports[it->second];
     }
 
-    Port get_output_port(std::string port_name) const {
-        for (size_t i = 0; i < output_ports.size(); i++) {
-            if (output_ports[i].name == port_name) {
-                return output_ports[i];
-            }
-        }
-        assert(false && "Output port not found!");
+    const Port& get_output_port(const std::string& port_name) const {
+        auto it = output_port_indices.find(port_name);
+        assert(it != output_port_indices.end() && "Output port not found!");
+        return output_ports[it->second];
     }
 
-    uint32_t get_output_port_index(std::string port_name) const {
-        for (size_t i = 0; i < output_ports.size(); i++) {
-            if (output_ports[i].name == port_name) {
-                return i;
-            }
-        }
-        return -1;
+    uint32_t get_output_port_index(const std::string& port_name) const {
+        auto it = output_port_indices.find(port_name);
+        return it != output_port_indices.end() ? it->second : -1;
     }
 
 
@@ -108,7 +275,22 @@ class Kernel {
     // the pipelining.
     std::vector<Port> input_ports;
     std::vector<Port> output_ports;
+    // Port name -> index into input_ports/output_ports, so lookups by name don't compare every port's name.
+    std::unordered_map<std::string, uint32_t> input_port_indices;
+    std::unordered_map<std::string, uint32_t> output_port_indices;
     CoreSpec core_spec; // Where this kernel will be placed.
+    uint32_t requested_replicas = 1;
+    uint32_t num_replicas = 1; // Resolved by the runtime from requested_replicas.
+    double cost = 0; // 0 means estimate it.
+    Reduction reduction = Reduction::None;
+    uint32_t reduction_window = 0;
+    struct Parameter {
+        std::string name;
+        float value;
+    };
+    std::vector<Parameter> parameters; // In runtime arg order.
+    bool math_approx = false;
+    std::vector<CoreCoord> replica_cores; // Core of each replica, in replica order.
     tt_metal::KernelHandle reader_kernel;
     tt_metal::KernelHandle compute_kernel;
     tt_metal::KernelHandle writer_kernel;
@@ -118,14 +300,175 @@ class Kernel {
     std::string sfpi_kernel_string;
 };
 
+class Map;
+
+// Long-lived handle on a device. Opening a device is expensive, so a session can be
+// shared by any number of maps and executions, and the device is closed when the session goes away.
+class Session {
+  public:
+    // trace_region_size reserves DRAM for metal traces, which captured maps replay from (see Map::set_capture()).
+    // Without one, they fall back to enqueueing the program again.
+    explicit Session(int device_id = 0, size_t trace_region_size = 0);
+    ~Session();
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    tt_metal::Device *get_device() const { return device; }
+    tt_metal::CommandQueue& command_queue() const { return device->command_queue(); }
+    int get_device_id() const { return device_id; }
+    bool supports_trace() const { return trace_region_size > 0; }
+
+  private:
+    friend class Map;
+
+    // A program that's already been built and compiled for some map, along with the handles
+    // needed to update its runtime args.
+    struct CachedProgram {
+        std::shared_ptr<tt_metal::Program> program;
+        std::vector<std::array<tt_metal::KernelHandle, 3>> kernel_handles; // Reader, compute, writer for each kernel.
+        std::vector<std::array<uint32_t, 3>> semaphores;                  // Sender, receiver, turn for each connection.
+        std::vector<std::vector<CoreCoord>> replica_cores;                // Placement the program was built for.
+        std::vector<std::vector<uint32_t>> cb_n_tiles;                    // CB depths of every input, then output port, for each kernel.
+    };
+
+    // Keyed on Map::program_signature(), so structurally identical maps share programs.
+    const CachedProgram *find_program(const std::string& signature) const;
+    void cache_program(const std::string& signature, CachedProgram program);
+
+    int device_id;
+    size_t trace_region_size;
+    tt_metal::Device *device;
+    std::unordered_map<std::string, CachedProgram> program_cache;
+    std::vector<Map *> captured_maps; // Maps captured on this session, their captures get dropped before the device closes.
+};
+
+// Handle on an in-flight execution of a map, returned by Map::execute_async().
+// Sink streams' host data shouldn't be touched until the execution is done.
+class Execution {
+  public:
+    // Blocks until the program and all reads back to the host have finished.
+    void wait();
+    // Non-blocking check of whether the execution has finished.
+    bool is_done();
+
+  private:
+    friend class Map;
+    std::shared_ptr<tt_metal::Event> event;
+    std::vector<std::shared_ptr<tt_metal::Buffer>> buffers; // Kept alive until the execution finishes.
+    // Sinks whose host data stops short of their last tile are read into staging first, and copied over once done.
+    struct PartialRead {
+        std::vector<uint32_t> staging;
+        std::span<uint32_t> host_data;
+    };
+    std::vector<PartialRead> partial_reads;
+    bool done = false;
+    void finish();
+};
+
+// Where the time went in a profiled execution, see Map::set_profiling().
+// Percentages are of the time the RISC in question was running, averaged over replicas.
+struct ProfileReport {
+    struct PortProfile {
+        std::string name;
+        uint64_t tiles;
+        uint64_t bytes;
+        double tiles_per_second;
+        double full_stall_pct;  // Side filling the port's CB blocked on it being full.
+        double empty_stall_pct; // Side draining the port's CB blocked on it being empty.
+        double noc_wait_pct;    // Reader/writer waiting on the kernel at the other end of the connection.
+    };
+    struct KernelProfile {
+        uint32_t replicas;
+        uint64_t cycles; // Slowest replica, start to finish.
+        double seconds;
+        double read_barrier_pct;
+        double write_barrier_pct;
+        std::vector<PortProfile> inputs;
+        std::vector<PortProfile> outputs;
+    };
+    uint32_t clock_mhz;
+    std::vector<KernelProfile> kernels;
+};
+
+// Wall time of each phase of an execution, see Map::set_phase_timing().
+struct PhaseTimings {
+    double setup_seconds;          // Placement, kernel generation and program build (or cache lookup).
+    double host_to_device_seconds;
+    double program_seconds;
+    double device_to_host_seconds;
+};
+
 class Map {
   public:
     Map(std::vector<Kernel *> kernels, std::vector<Stream *> streams);
+    ~Map();
     void add_connection(Kernel *src, std::string src_out, Kernel *dst, std::string dst_in);
     void add_connection(Stream *src, Kernel *dst, std::string dst_in);
     void add_connection(Kernel *src, std::string src_out, Stream *dst);
+    // Opens device 0 for the duration of a single execution. Captured maps need a session that outlives them.
     void execute();
+    // Runs on an already open device.
+    void execute(Session& session);
+    // Enqueues the writes, the program and the reads without blocking, so the host can
+    // prepare the next batch while the device is busy. Executions on a session run in order.
+    Execution execute_async(Session& session);
+    // Runs the map over windows of chunk_tiles tiles at a time through a ring of fixed size DRAM chunks,
+    // so neither the device nor the host ever needs to hold an entire stream. Required for streams
+    // created with Stream::from_producer() / Stream::to_consumer().
+    void execute_streaming(Session& session, uint32_t chunk_tiles);
+    // Splits every stream into one slice of whole batches per session, and runs the entire map on each device over
+    // its own slice at the same time. Sink slices get gathered back into the sinks' host data. Blocks until every
+    // device is done.
+    void execute_data_parallel(const std::vector<Session *>& sessions);
+    // # of tiles moved per NoC barrier in the reader/writer and per CB wait in compute.
+    // CBs are at least double buffered at this batch size.
+    void set_tiles_per_batch(uint32_t n) { assert(n > 0 && "Batch size must be non-zero!"); tiles_per_batch = n; }
+    // How replicas get assigned to cores.
+    enum class Placement {
+        Sequential, // Next free core in grid order.
+        Greedy,     // Cheapest free core given what's already placed, minimizing bytes x NoC hops.
+        Search,     // Greedy, then local search over moves and swaps.
+    };
+    void set_placement(Placement p) { placement = p; }
+    // Bytes of L1 per core that CBs are allowed to use. Defaults to all of the core's unreserved L1.
+    void set_cb_l1_budget(uint32_t bytes) { cb_l1_budget = bytes; }
+    // How compute and the packer share DST. Full sync hands all of DST to compute, and the packer only gets it once compute is done.
+    // Half sync splits DST in two, so compute fills one half while the packer drains the other, with half as many tiles per acquire.
+    enum class DstSync { Full, Half };
+    void set_dst_sync(DstSync sync) { dst_sync = sync; }
+    // When a stream feeds several kernels, only one of them reads it from DRAM and forwards every batch
+    // over the NoC into the other consumers' CBs. On by default.
+    void set_stream_sharing(bool enable) { stream_sharing = enable; }
+    // Instruments the generated kernels with cycle counters around CB waits and NoC barriers.
+    // execute() collects them into a report. After execute_async(), call collect_profile() once the execution is done.
+    void set_profiling(bool enable) { profiling = enable; }
+    const ProfileReport& collect_profile();
+    const std::optional<ProfileReport>& get_profile() const { return profile; }
+    void export_profile_json(const std::string& filename) const;
+    // Makes execute_async() wait for the queue between phases and time each one, for benchmarking.
+    // This serializes the writes, the program and the reads, so it shouldn't be left on otherwise.
+    void set_phase_timing(bool enable) { phase_timing = enable; }
+    const std::optional<PhaseTimings>& get_phase_timings() const { return phase_timings; }
+    // Capture once, replay many. The next execute_async() sets up buffers, places and builds the program as usual,
+    // then freezes all of it. Later executions on the same session only write the sources into the existing buffers,
+    // replay the program and read the sinks back. Until the capture is dropped, the map, its settings and its streams'
+    // sizes and memory mustn't change, only the contents of the sources. Disabling it, destroying the map or closing
+    // the session drops the capture.
+    void set_capture(bool enable);
+    // Debug mode for hangs. The generated kernels publish what every RISC is blocked on, and how many tiles went through
+    // each port, to a status region in L1. The host polls it, and if nothing in it changed for timeout_seconds while the
+    // execution still isn't done, reports which ports are starved or full. execute() then exits, after execute_async()
+    // call watch() instead of wait().
+    void set_watchdog(bool enable, double timeout_seconds = 10.0) { watchdog = enable; watchdog_timeout = timeout_seconds; }
+    // Waits for the execution for as long as it keeps making progress. Returns false if it hung, see get_hang_report().
+    bool watch(Execution& execution);
+    const std::optional<std::string>& get_hang_report() const { return hang_report; }
+    bool is_captured() const { return captured.has_value(); }
     void generate_device_kernels();
+    // Optimization pass, run before generating kernels. Merges linear chains of kernels (single consumer,
+    // single input) into one kernel whose SFPI body runs both stages back to back, so intermediates stay
+    // in registers instead of going through CBs and the NoC. Returns the # of kernels fused away.
+    size_t fuse_kernels();
     void check_connections();
 
     // Visualize the work graph.
@@ -138,13 +481,18 @@ class Map {
     void export_dot(const std::string& filename) const;
 
   private:
+    friend class Session; // Drops captures when it closes.
     struct Runtime {
         tt_metal::Device *device;
-        tt_metal::Program program;
+        std::shared_ptr<tt_metal::Program> program; // Shared with the session's program cache.
         uint32_t num_cores;
         uint32_t num_cores_x;
         uint32_t num_cores_y;
         std::set<tt_metal::CoreRange> core_set;
+        uint32_t l1_budget; // Bytes of L1 per core available for CBs.
+        std::shared_ptr<tt_metal::Buffer> profile_buffer; // L1 scratch at the same address on every core, when profiling.
+        std::shared_ptr<tt_metal::Buffer> gather_scratch; // Same, holds the index tile each gather port is working through.
+        std::shared_ptr<tt_metal::Buffer> watchdog_buffer; // Same, holds the watchdog records.
     };
 
     // Represents a connection endpoint (either kernel or stream)
@@ -162,41 +510,177 @@ class Map {
     struct Connection {
         Endpoint source;
         Endpoint dest;
+        // Flow control semaphores for Kernel -> Kernel connections (IDs returned by CreateSemaphore).
+        // The sender semaphore lives on the producer core and holds the L1 address of the next free slot in the consumer's CB.
+        // The receiver semaphore lives on the consumer core and is incremented by the producer once a tile has landed.
+        // When the consumer has more replicas than the producer, each producer replica feeds several consumers in turn.
+        // The turn semaphore lives on the consumer core and tells it when it may hand the producer its next slot.
+        uint32_t sender_semaphore = 0;
+        uint32_t receiver_semaphore = 0;
+        uint32_t turn_semaphore = 0;
     };
 
     Runtime runtime;
     std::vector<Kernel *> kernels;
     std::vector<Stream *> streams;
     std::vector<Connection> connections;
+    std::vector<std::unique_ptr<Kernel>> owned_kernels; // Kernels created by passes like fuse_kernels().
+    size_t num_fused_kernels = 0;
+    uint32_t tiles_per_batch = 1;
+    uint32_t cb_l1_budget = 0;
+    Placement placement = Placement::Greedy;
+    bool profiling = false;
+    bool stream_sharing = true;
+    DstSync dst_sync = DstSync::Full;
+    bool phase_timing = false;
+    std::optional<PhaseTimings> phase_timings;
+    bool watchdog = false;
+    double watchdog_timeout = 10.0;
+    std::optional<std::string> hang_report;
+    std::optional<ProfileReport> profile;
+    std::optional<uint32_t> window_tiles; // Set while streaming, overrides every stream's # of tiles.
+    bool capture = false;
+    struct Capture {
+        Session *session;
+        std::optional<uint32_t> trace_id; // Set if the session supports traces.
+    };
+    std::optional<Capture> captured;
+
+    // Graph IR over kernels, streams and connections, so nothing has to scan them. Kept in sync by add_connection()
+    // and fuse_kernels(). Adjacency lists hold indices into connections, in the order the connections were added,
+    // which is the order inN/outN and the generated kernels follow.
+    struct Graph {
+        std::unordered_map<const Kernel *, size_t> kernel_index;
+        std::unordered_map<const Stream *, size_t> stream_index;
+        std::vector<std::vector<size_t>> incoming; // Per kernel.
+        std::vector<std::vector<size_t>> outgoing; // Per kernel.
+        std::vector<std::vector<size_t>> readers;  // Per stream, connections reading from it.
+        std::vector<std::vector<size_t>> writers;  // Per stream, connections writing to it.
+        // Topological order of the kernels and each kernel's position in it, worked out on first use.
+        // Kernels on a cycle never make it into the order.
+        mutable std::vector<size_t> order;
+        mutable std::vector<size_t> rank;
+        mutable bool ordered = false;
+    };
+    Graph graph;
+    void rebuild_graph();
+    void add_to_graph(size_t connection_idx);
+    void order_graph() const;
+
+    uint32_t stream_n_tiles(const Stream *stream) const { return window_tiles.value_or(stream->n_tiles); }
+    // Tiles a port moves per batch. A batch is tiles_per_batch steps of the kernel.
+    uint32_t port_batch_tiles(const Kernel::Port& port) const { return tiles_per_batch * port.rate; }
+    // Port on the kernel side of a connection. Both ends of a kernel -> kernel connection have the same rate.
+    Kernel::Port connection_port(const Connection& connection) const;
 
     // // Entry <port_out, port_in> at [i][j] represents a connection from kernel i's output port port_out to kernel j's input port port_in.
     // std::vector<std::vector<std::pair<std::string, std::string>>> port_map;
     // // Entry <port_name> at [i][j] represents a connection from stream i to kernel j's input port port_name.
     // std::vector<std::vector<std::string>> stream_port_map;
 
-    std::vector<Connection> get_incoming_connections(Kernel *kernel);
-    std::vector<Connection> get_outgoing_connections(Kernel *kernel);
-
-    size_t get_kernel_index(Kernel *kernel) {
-        auto it = std::find(kernels.begin(), kernels.end(), kernel);
-        assert(it != kernels.end() && "Kernel not found in kernels vector");
-        return it - kernels.begin();
+    std::vector<Connection> get_incoming_connections(Kernel *kernel) const;
+    std::vector<Connection> get_outgoing_connections(Kernel *kernel) const;
+    uint32_t get_n_tiles(const Connection& connection) const;
+    // Generated kernels are specialized through compile-time args and defines on whatever is known when the program is built.
+    bool has_equal_port_lengths(const std::vector<Connection>& connections) const;
+    std::map<std::string, std::string> kernel_defines(Kernel *kernel, const std::vector<Connection>& connections) const;
+    // Where a compute kernel keeps its tiles in DST. Every tile in flight gets its own group of slots_per_tile slots,
+    // and each port sits at a fixed slot within the group.
+    struct DstLayout {
+        std::vector<uint32_t> input_slots; // Per incoming connection, empty if inputs don't go through DST.
+        std::vector<uint32_t> output_slots; // Per outgoing connection.
+        uint32_t slots_per_tile;
+        uint32_t tiles_per_acquire;
+    };
+    DstLayout dst_layout(Kernel *kernel, const std::vector<Connection>& incoming_connections, const std::vector<Connection>& outgoing_connections) const;
+    bool uses_fp32_dest(Kernel *kernel) const;
+    // # of tiles compute gets to use per acquire.
+    uint32_t dst_capacity(bool fp32_dest) const;
+    std::vector<uint32_t> port_tile_bytes(Kernel *kernel, const std::vector<Connection>& connections, bool incoming) const;
+    // The kernel's eltwise op, if the FPU can run it on these ports.
+    std::optional<Kernel::Eltwise> fpu_eltwise(Kernel *kernel, const std::vector<Connection>& incoming_connections, const std::vector<Connection>& outgoing_connections) const;
+    void resolve_replicas(uint32_t total_cores);
+    // Picks a depth for every port's CB and returns the total L1 footprint in bytes.
+    uint32_t size_circular_buffers(Kernel *kernel, const std::vector<Connection>& incoming_connections, const std::vector<Connection>& outgoing_connections, uint32_t l1_budget);
+    // # of tiles of a stream that a replica handles. Batches are dealt out round-robin, replica r gets batches r, r + num_replicas, ...,
+    // so this is the sum of those batches' sizes, including the last batch if it's partial.
+    static uint32_t replica_n_tiles(uint32_t n_tiles, uint32_t batch_size, uint32_t num_replicas, uint32_t replica);
+    static std::vector<uint32_t> connected_replicas(uint32_t num_replicas, uint32_t num_peer_replicas, uint32_t replica);
+    std::vector<size_t> connected_kernels(size_t kernel_idx) const;
+    // Stream sharing, see set_stream_sharing(). The leader is the consumer that comes first in topological order,
+    // so no follower is ever upstream of the kernel it waits on. Returns nullptr if the connection reads from DRAM itself.
+    const Connection *shared_stream_leader(const Connection& connection) const;
+    std::vector<Connection> shared_stream_followers(const Connection& connection) const;
+    // Kernel that fills the CB of an incoming connection over the NoC, nullptr if it's read from DRAM.
+    Kernel *upstream_kernel(const Connection& connection) const;
+
+    size_t get_kernel_index(Kernel *kernel) const {
+        auto it = graph.kernel_index.find(kernel);
+        assert(it != graph.kernel_index.end() && "Kernel not found in kernels vector");
+        return it->second;
     }
 
-    size_t get_stream_index(Stream *stream) {
-        auto it = std::find(streams.begin(), streams.end(), stream);
-        assert(it != streams.end() && "Stream not found in streams vector");
-        return it - streams.begin();
+    size_t get_stream_index(Stream *stream) const {
+        auto it = graph.stream_index.find(stream);
+        assert(it != graph.stream_index.end() && "Stream not found in streams vector");
+        return it->second;
     }
 
     void add_connection(const Endpoint& src, const Endpoint& dst) {
-        connections.push_back({src, dst});
+        connections.push_back({src, dst, 0, 0});
+        add_to_graph(connections.size() - 1);
     }
 
-    void generate_reader_device_kernel(Kernel *kernel, std::vector<Connection> incoming_connections);
-    void generate_compute_device_kernel(Kernel *kernel, std::vector<Connection> incoming_connections, std::vector<Connection> outgoing_connections);
-    void generate_writer_device_kernel(Kernel *kernel, std::vector<Connection> outgoing_connections);
+    // Execution phases.
+    void setup_cores();
+    void setup_profile_buffer();
+    // What a RISC can be blocked on, as published to the watchdog.
+    enum class WatchdogWait : uint32_t { None, CbFull, CbEmpty, Upstream, Downstream, Barrier };
+    // Wraps a blocking call in the generated code with a cycle counter when profiling, and has it publish what it waits for to
+    // the watchdog. Compute passes the TRISC that does the waiting ("UNPACK" or "PACK").
+    std::string instrument_wait(const std::string& indent, const std::string& code, uint32_t counter,
+                                WatchdogWait wait, uint32_t port, const std::string& trisc = "") const;
+    // Adds tiles to the watchdog's count for a port.
+    std::string watchdog_tiles(const std::string& indent, uint32_t word, const std::string& tiles, const std::string& trisc = "") const;
+    void setup_watchdog_buffer();
+    void reset_watchdog(Session& session);
+    std::vector<uint32_t> read_watchdog_records(const CoreCoord& core) const;
+    std::string watchdog_report();
+    void place_kernels(const std::vector<CoreCoord>& cores);
+    const std::vector<size_t>& topological_order() const;
+    void setup_stream_buffers(Session& session);
+    // Bases and index streams of views that aren't part of the map themselves, but still need a device buffer.
+    std::vector<Stream *> backing_streams() const;
+    // Sharded streams can only be laid out once we know which cores read them.
+    void setup_sharded_stream_buffers(Session& session);
+    void write_sharded_stream(Session& session, size_t stream_idx);
+    // Refills the existing device buffers of every source from its host data, for replays.
+    void write_source_streams(Session& session);
+    // Writes a stream's host data into its device buffer, padding out a partial last tile.
+    void write_stream_buffer(Session& session, Stream *stream);
+    // The one connection reading a sharded stream from memory.
+    const Connection& sharded_stream_reader(size_t stream_idx) const;
+    // Bytes of every core's L1 taken up by L1 and sharded streams, and the gather scratch.
+    uint32_t l1_stream_bytes_per_core() const;
+    // Most gather ports on any one kernel, each gets an index tile of scratch.
+    uint32_t max_gather_ports() const;
+    void setup_gather_scratch();
+    void build_program();
+    void set_runtime_args();
+    // Describes everything that goes into building the program. Used as the program cache key.
+    std::string program_signature() const;
+    Session::CachedProgram snapshot_program() const;
+    void restore_program(const Session::CachedProgram& cached);
+    void capture_program(Session& session);
+    void release_capture();
+
+    std::string generate_reader_device_kernel(Kernel *kernel, std::vector<Connection> incoming_connections) const;
+    std::string generate_compute_device_kernel(Kernel *kernel, std::vector<Connection> incoming_connections, std::vector<Connection> outgoing_connections) const;
+    std::string generate_writer_device_kernel(Kernel *kernel, std::vector<Connection> outgoing_connections) const;
     bool has_incoming_connection(Kernel *kernel);
+    bool is_fusable(const Connection& connection);
+    bool is_source_stream(size_t stream_idx) const;
+    bool is_sink_stream(size_t stream_idx) const;
 };
 
 } // End namespace current.